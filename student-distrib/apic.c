@@ -0,0 +1,75 @@
+#include "apic.h"
+#include "clockevents.h"
+#include "timer.h"
+#include "intr.h"
+#include "lib.h"
+
+/* Map registers of local APIC and enable it, lint0 keeps delivering interrupts of 8259 PIC */
+void apic_init()
+{
+    set_fixmap(FIX_APIC_BASE, APIC_DEFAULT_PHYS_BASE);
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    apic_write(APIC_LVTT, APIC_LVT_MASKED);
+}
+
+static void lapic_timer_set_mode(struct clock_event_device *dev, int mode)
+{
+    /* only one-shot mode is used, the counter is started by lapic_next_event() */
+    if (mode == CLOCK_EVT_MODE_ONESHOT)
+        apic_write(APIC_LVTT, APIC_LOCAL_TIMER_ONESHOT_MODE | LOCAL_APIC_TIMER_INTR);
+    else
+        apic_write(APIC_LVTT, APIC_LVT_MASKED);
+    apic_write(APIC_TMICT, 0);
+}
+
+static void lapic_next_event(struct clock_event_device *dev, uint32_t delta_us)
+{
+    apic_write(APIC_TMICT, (uint32_t)div_u64((uint64_t)delta_us * dev->khz, 1000));
+}
+
+static void lapic_timer_ack(struct clock_event_device *dev)
+{
+    ack_APIC_irq();
+}
+
+static struct clock_event_device lapic_clockevent = {
+    .name = "lapic",
+    .features = CLOCK_EVT_FEAT_ONESHOT,
+    .rating = 100,
+    .irq = LOCAL_APIC_TIMER_INTR,
+    .set_mode = lapic_timer_set_mode,
+    .set_next_event = lapic_next_event,
+    .ack = lapic_timer_ack,
+};
+
+/*
+ * Count timer ticks of local APIC in CALIBRATE_MS measured by PIT, its frequency is the bus clock divided by 16
+ * @return: the clock event device, NULL if it can't be calibrated
+ */
+struct clock_event_device* apic_timer_init()
+{
+    struct clock_event_device *dev = &lapic_clockevent;
+    unsigned long flags;
+    uint32_t count;
+    uint64_t max;
+
+    cli_and_save(flags);
+    apic_write(APIC_TDCR, APIC_TDR_DIV_16);
+    apic_write(APIC_LVTT, APIC_LVT_MASKED | APIC_LOCAL_TIMER_ONESHOT_MODE);
+    pit_calibrate_start(CALIBRATE_MS);
+    apic_write(APIC_TMICT, 0xffffffff);
+    while (!pit_calibrate_done())
+        ;
+    count = 0xffffffff - apic_read(APIC_TMCCT);
+    apic_write(APIC_TMICT, 0);
+    restore_flags(flags);
+
+    dev->khz = count / CALIBRATE_MS;
+    if (!dev->khz)
+        return NULL;
+    /* at least one count, and no more than the counter holds */
+    dev->min_delta_us = 1000 / dev->khz + 1;
+    max = div_u64(0xffffffffULL * 1000, dev->khz);
+    dev->max_delta_us = max > 0xffffffff ? 0xffffffff : (uint32_t)max;
+    return dev;
+}
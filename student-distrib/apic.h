@@ -0,0 +1,50 @@
+#ifndef _APIC_H
+#define _APIC_H
+
+#include "types.h"
+#include "mm.h"
+
+#define APIC_DEFAULT_PHYS_BASE 0xFEE00000
+
+/* Registers of local APIC, offsets from its base */
+#define APIC_ID     0x20
+#define APIC_EOI    0xB0
+#define APIC_SVR    0xF0    // spurious interrupt vector register
+#define APIC_LVTT   0x320   // LVT timer register
+#define APIC_TMICT  0x380   // initial count of timer
+#define APIC_TMCCT  0x390   // current count of timer
+#define APIC_TDCR   0x3E0   // divide configuration of timer
+
+#define APIC_SVR_ENABLE (1 << 8)
+#define APIC_SPURIOUS_VECTOR 0xff
+
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_LOCAL_TIMER_ONESHOT_MODE  (0)
+#define APIC_LOCAL_TIMER_PERIODIC_MODE (1 << 17)
+#define APIC_LOCAL_TIMER_TSCDDL_MODE   (2 << 17)
+#define APIC_LOCAL_TIMER_DELIVERT_IDLE (0)
+#define APIC_LOCAL_TIMER_DELIVERT_PENDING (1 << 11)
+
+#define APIC_TDR_DIV_16 0x3
+
+static inline uint32_t apic_read(uint32_t reg)
+{
+    return *(volatile uint32_t*)(fix_to_virt(FIX_APIC_BASE) + reg);
+}
+
+static inline void apic_write(uint32_t reg, uint32_t val)
+{
+    *(volatile uint32_t*)(fix_to_virt(FIX_APIC_BASE) + reg) = val;
+}
+
+static inline void ack_APIC_irq()
+{
+    apic_write(APIC_EOI, 0);
+}
+
+struct clock_event_device;
+
+extern void apic_init();
+extern struct clock_event_device* apic_timer_init();
+
+#endif
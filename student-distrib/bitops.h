@@ -0,0 +1,45 @@
+#ifndef _BITOPS_H
+#define _BITOPS_H
+
+#include "types.h"
+
+#define BITS_PER_LONG 32
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+/*
+ * Find the first(least significant) set bit in word.
+ * @NOTE: result is undefined if word is 0, caller must check it.
+ */
+static inline uint32_t __ffs(uint32_t word)
+{
+    asm ("bsfl %1, %0"
+         : "=r"(word)
+         : "rm"(word));
+    return word;
+}
+
+/* Find the last(most significant) set bit in word. Undefined if word is 0 */
+static inline uint32_t __fls(uint32_t word)
+{
+    asm ("bsrl %1, %0"
+         : "=r"(word)
+         : "rm"(word));
+    return word;
+}
+
+static inline void set_bit(uint32_t nr, uint32_t *addr)
+{
+    addr[nr / BITS_PER_LONG] |= (1u << (nr % BITS_PER_LONG));
+}
+
+static inline void clear_bit(uint32_t nr, uint32_t *addr)
+{
+    addr[nr / BITS_PER_LONG] &= ~(1u << (nr % BITS_PER_LONG));
+}
+
+static inline bool test_bit(uint32_t nr, const uint32_t *addr)
+{
+    return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+#endif
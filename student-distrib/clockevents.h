@@ -0,0 +1,42 @@
+#ifndef _CLOCKEVENTS_H
+#define _CLOCKEVENTS_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * @NOTE: about clock event devices
+ *   A clock event device raises an interrupt after a programmed time(one-shot), or every tick(periodic). The best
+ *   registered device drives the tick, see timer.c. A one-shot device is preferred, since it can be left silent
+ *   when the cpu has nothing to do.
+ */
+#define CLOCK_EVT_FEAT_PERIODIC (1 << 0)
+#define CLOCK_EVT_FEAT_ONESHOT  (1 << 1)
+
+#define CLOCK_EVT_MODE_SHUTDOWN 0
+#define CLOCK_EVT_MODE_PERIODIC 1
+#define CLOCK_EVT_MODE_ONESHOT  2
+
+struct clock_event_device {
+    const char *name;
+    uint32_t features;
+    uint32_t rating;            // the device of the highest rating is used
+    uint32_t irq;               // interrupt vector
+    uint32_t khz;               // frequency of its counter
+    uint32_t min_delta_us;      // range of set_next_event()
+    uint32_t max_delta_us;
+    int mode;
+
+    void (*set_mode)(struct clock_event_device *dev, int mode);
+    /* one-shot only, raise the interrupt after delta_us */
+    void (*set_next_event)(struct clock_event_device *dev, uint32_t delta_us);
+    /* end of interrupt */
+    void (*ack)(struct clock_event_device *dev);
+    struct list list;
+};
+
+extern void clockevents_register_device(struct clock_event_device *dev);
+extern void clockevents_set_mode(struct clock_event_device *dev, int mode);
+extern void clockevents_program_event(struct clock_event_device *dev, uint32_t delta_us);
+
+#endif
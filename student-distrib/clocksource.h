@@ -0,0 +1,40 @@
+#ifndef _CLOCKSOURCE_H
+#define _CLOCKSOURCE_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * @NOTE: about clocksource
+ *   A clocksource is a free running counter, time is kept by reading it, see timekeeping.c. Cycles are converted
+ *   to nanoseconds by (cycles * mult) >> shift, so no division is needed. The registered clocksource of the highest
+ *   rating is used.
+ *   A continuous clocksource keeps counting when there is no timer interrupt, the tick can only be stopped with
+ *   such a clocksource.
+ */
+#define CLOCK_SOURCE_IS_CONTINUOUS (1 << 0)
+
+struct clocksource {
+    const char *name;
+    uint32_t rating;
+    uint64_t (*read)(struct clocksource *cs);
+    uint64_t mask;          // counter wraps at mask + 1
+    uint32_t mult;
+    uint32_t shift;
+    uint32_t flags;
+    struct list list;
+};
+
+static inline uint64_t clocksource_cyc2ns(struct clocksource *cs, uint64_t cycles)
+{
+    return (cycles * cs->mult) >> cs->shift;
+}
+
+extern uint32_t clocksource_khz2mult(uint32_t khz, uint32_t shift);
+extern void clocksource_register(struct clocksource *cs);
+
+extern void timekeeping_init();
+extern void update_wall_time();
+extern bool timekeeping_continuous();
+
+#endif
@@ -74,13 +74,16 @@ void disable_irq(uint32_t irq_num) {
     uint16_t port;
     uint8_t value;
 
+    /* vectors of slave follow those of master, so irq 8-15 are on slave */
+    irq_num -= PIC_MASTER_FIRST_INTR;
+
     if (irq_num & 8) {
         // slave
-        port = PIC_SLAVE;
+        port = PIC_SLAVE_DATA;
         irq_num -= 8;
     } else {
         // master
-        port = PIC_MASTER;
+        port = PIC_MASTER_DATA;
     }
     value = inb(port) | (1 << irq_num);
     outb(value, port);
@@ -91,11 +94,8 @@ void enable_irq(uint32_t irq_num) {
     uint16_t port;
     uint32_t value;
 
-    if (irq_num >= PIC_SLAVE_FIRST_INTR) {
-        irq_num -= PIC_SLAVE_FIRST_INTR;
-    } else {
-        irq_num -= PIC_MASTER_FIRST_INTR;
-    }
+    /* vectors of slave follow those of master, so irq 8-15 are on slave */
+    irq_num -= PIC_MASTER_FIRST_INTR;
 
     if (irq_num & 8) {
         // slave
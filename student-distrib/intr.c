@@ -248,6 +248,7 @@ void early_setup_idt()
 
     set_system_gate(SYSCALL_INTR, syscall_interrupt_entry);
     set_intr_gate(PIC_TIMER_INTR, timer_interrupt_entry);
+    set_intr_gate(LOCAL_APIC_TIMER_INTR, timer_interrupt_entry);
 
     set_intr_gate(PIC_KEYBOARD_INTR, intr0x31_entry);
     set_intr_gate(PIC_MOUSE_INTR, intr0x3C_entry);
@@ -263,7 +264,7 @@ void early_setup_idt()
 unsigned long generic_intr_handler(unsigned long intr_num, unsigned long esp)
 {
     if (intr_entry[intr_num].intr_handler)
-        intr_entry[intr_num].intr_handler();
+        intr_entry[intr_num].intr_handler((struct intr_frame*)esp);
     else
         KERN_INFO("unsupported intr 0x%x\n", intr_num);
     send_eoi(intr_num - PIC_MASTER_FIRST_INTR);
@@ -13,6 +13,8 @@
 #define PIC_RTC_INTR      0x38
 #define PIC_MOUSE_INTR    0x3C
 
+#define LOCAL_APIC_TIMER_INTR 0xbf
+
 #define SYSCALL_INTR 0x80
 
 /*
@@ -25,4 +27,39 @@
 
 #define KERNEL_RPL 0
 #define USER_RPL   3
+
+#ifndef ASM
+#include "types.h"
+
+/* Stack layout built by common_intr_entry, handlers get a pointer to it */
+struct intr_frame {
+    uint32_t gs;
+    uint32_t fs;
+    uint32_t es;
+    uint32_t ds;
+    /* pushed by pusha */
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t esp_dummy;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+
+    uint32_t error_code;    // 0 if the exception has no error code
+    /* pushed by cpu */
+    uint32_t eip;
+    uint32_t cs;
+    uint32_t eflags;
+    uint32_t esp;   // only exists when privilege level changed
+    uint32_t ss;    // only exists when privilege level changed
+} __attribute__ ((packed));
+
+static inline bool intr_from_user(struct intr_frame *frame)
+{
+    return (frame->cs & 3) == USER_RPL;
+}
+#endif /* ASM */
+
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "timer.h"
 
 
+/* handlers may take a struct intr_frame* argument, see generic_intr_handler() */
 typedef void (*intr_handler_t)();
 
 struct intr_entry {
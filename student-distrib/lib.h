@@ -179,6 +179,17 @@ do {                                    \
     );                                  \
 } while (0)
 
+/* Enable interrupts and wait for one. No interrupt can slip in between, sti takes effect after the next
+ * instruction, so call it with interrupts disabled after checking there is nothing to do */
+#define safe_halt()                     \
+do {                                    \
+    asm volatile ("sti; hlt"            \
+            :                           \
+            :                           \
+            : "memory", "cc"            \
+    );                                  \
+} while (0)
+
 /* Restore flags
  * Puts the value in "flags" into the EFLAGS register.  Most often used
  * after a cli_and_save_flags(flags) */
@@ -205,6 +216,29 @@ static inline void cpuid(uint32_t op, uint32_t regs[4])
 	    : "memory");
 }
 
+/* Read time stamp counter, it increases by one every cpu cycle */
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* 64-bit by 32-bit division, there is no libgcc to do it for '/' */
+static inline uint64_t div_u64(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t high = dividend >> 32, low = (uint32_t)dividend;
+    uint32_t q_high = 0, rem;
+
+    if (high >= divisor) {
+        q_high = high / divisor;
+        high %= divisor;
+    }
+    /* high < divisor now, so the quotient of edx:eax fits in eax */
+    asm ("divl %2" : "=a"(low), "=d"(rem) : "rm"(divisor), "0"(low), "1"(high));
+    return ((uint64_t)q_high << 32) | low;
+}
+
 /*
  * Wait a very small amount of time (1 to 4 microseconds, generally).
  * Useful for implementing a small delay for PIC remapping on old hardware or generally as a simple but imprecise wait.
@@ -1,91 +1,43 @@
 #include "liballoc.h"
+#include "slab.h"
+#include "mm.h"
+#include "bitops.h"
+#include "mm_debug.h"
 
 /**  Durand's Amazing Super Duper Memory functions.  */
 
-#define VERSION 	"1.1"
-#define ALIGNMENT	16ul//4ul				///< This is the byte alignment that memory must be allocated on. IMPORTANT for GTK and other stuff.
+#define VERSION 	"2.0"
+#define ALIGNMENT	16ul				///< This is the byte alignment that memory must be allocated on. IMPORTANT for GTK and other stuff.
 
-#define ALIGN_TYPE		char ///unsigned char[16] /// unsigned short
-#define ALIGN_INFO		sizeof(ALIGN_TYPE)*16	///< Alignment information is stored right before the pointer. This is the number of bytes of information stored there.
-
-
-#define USE_CASE1
-#define USE_CASE2
-#define USE_CASE3
-#define USE_CASE4
-#define USE_CASE5
-
-
-/** This macro will conveniently align our pointer upwards */
-#define ALIGN(ptr)											\
-if (ALIGNMENT > 1) {										\
-	ptr_t diff;												\
-	ptr = (void*)((ptr_t)ptr + ALIGN_INFO);					\
-	diff = (ptr_t)ptr & (ALIGNMENT-1);						\
-	if (diff != 0) {										\
-		diff = ALIGNMENT - diff;							\
-		ptr = (void*)((ptr_t)ptr + diff);					\
-	}														\
-	*((ALIGN_TYPE*)((ptr_t)ptr - ALIGN_INFO)) = 			\
-		diff + ALIGN_INFO;									\
-}
-
-
-#define UNALIGN(ptr)											\
-if (ALIGNMENT > 1) {											\
-	ptr_t diff = *((ALIGN_TYPE*)((ptr_t)ptr - ALIGN_INFO));	    \
-	if (diff < (ALIGNMENT + ALIGN_INFO)) {						\
-		ptr = (void*)((ptr_t)ptr - diff);	    				\
-	}															\
-}
-
-
-
-#define LIBALLOC_MAGIC	0xc001c0de
-#define LIBALLOC_DEAD	0xdeaddead
-
-/** A structure found at the top of all system allocated
- * memory blocks. It details the usage of the memory block.
+/*
+ * @NOTE: about size classes
+ *   Small requests are rounded up to one of the size classes below and served by the slab cache of that class,
+ *   power of 2 classes have 96 and 192 in between, because 65~96 and 129~192 bytes requests are common.
+ *   Requests larger than the biggest class get (1 << order) pages directly from buddy system, the order is kept
+ *   in struct page of the first page, so kfree() knows the size from the address without any header.
+ *   Both paths are O(1), no matter how many blocks were allocated or freed before.
  */
-struct liballoc_major
-{
-	struct liballoc_major *prev;		///< Linked list information.
-	struct liballoc_major *next;		///< Linked list information.
-	unsigned int pages;					///< The number of pages in the block.
-	unsigned int size;					///< The number of pages in the block.
-	unsigned int usage;					///< The number of bytes used in the block.
-	struct liballoc_minor *first;		///< A pointer to the first allocated memory in the block.
-};
-
+#define NR_SIZE_CLASSES	KMALLOC_NR_CLASSES
+#define MAX_CLASS_SIZE	2048
 
-/** This is a structure found at the beginning of all
- * sections in a major block which were allocated by a
- * malloc, calloc, realloc call.
- */
-struct	liballoc_minor
-{
-	struct liballoc_minor *prev;		///< Linked list information.
-	struct liballoc_minor *next;		///< Linked list information.
-	struct liballoc_major *block;		///< The owning block. A pointer to the major structure.
-	unsigned int magic;					///< A magic number to idenfity correctness.
-	unsigned int size; 					///< The size of the memory allocated. Could be 1 byte or more.
-	unsigned int req_size;				///< The size of memory requested.
+static const unsigned int class_size[NR_SIZE_CLASSES] = {
+	16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048
 };
 
-static struct liballoc_major *l_memRoot = NULL;	///< The root memory block acquired from the system.
-static struct liballoc_major *l_bestBet = NULL; ///< The major with the most free memory.
-
-static unsigned int l_pageSize  = 4096;			///< The size of an individual page. Set up in liballoc_init.
-static unsigned int l_pageOrder = 4;			///< The number of pages to request per chunk. Set up in liballoc_init.
-static unsigned long long l_allocated = 0;		///< Running total of allocated memory.
-static unsigned long long l_inuse	 = 0;		///< Running total of used memory.
-
-static long long l_warningCount = 0;		///< Number of warnings encountered
-static long long l_errorCount = 0;			///< Number of actual errors
-static long long l_possibleOverruns = 0;	///< Number of possible overruns
+static const char *class_name[NR_SIZE_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+	"kmalloc-192", "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
 
+/* class of size 1~256, indexed by (size - 1) / 16 */
+static const unsigned char small_class_index[16] = {
+	0, 1, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6
+};
 
+static struct kmem_cache *kmalloc_caches[NR_SIZE_CLASSES];
 
+static uint32_t l_allocated = 0;			///< Running total of bytes allocated for large blocks.
+static struct kmalloc_stats l_stats;		///< allocated and class_size are filled by kmalloc_get_stats()
 
 
 // ***********   HELPER FUNCTIONS  *******************************
@@ -124,477 +76,216 @@ static void* liballoc_memcpy(void* s1, const void* s2, size_t n)
 }
 
 
-static void liballoc_dump()
+void kmalloc_get_stats(struct kmalloc_stats *stats)
 {
-	struct liballoc_major *maj = l_memRoot;
-	struct liballoc_minor *min = NULL;
+	unsigned long flags;
+	int i;
+
+	liballoc_lock(&flags);
+	liballoc_memcpy(stats, &l_stats, sizeof(*stats));
+	stats->allocated = l_allocated;
+	for (i = 0; i < NR_SIZE_CLASSES; ++i) {
+		stats->class_size[i] = class_size[i];
+		stats->allocated += (kmalloc_caches[i]->nr_slabs * PAGE_SIZE) << kmalloc_caches[i]->order;
+	}
+	liballoc_unlock(flags);
+}
 
+void liballoc_dump()
+{
+	struct kmalloc_stats stats;
+	int i;
+
+	kmalloc_get_stats(&stats);
 	printf( "liballoc: ------ Memory data ---------------\n");
-	printf( "liballoc: System memory allocated: %i bytes\n", l_allocated );
-	printf( "liballoc: Memory in used (malloc'ed): %i bytes\n", l_inuse );
-	printf( "liballoc: Warning count: %i\n", l_warningCount );
-	printf( "liballoc: Error count: %i\n", l_errorCount );
-	printf( "liballoc: Possible overruns: %i\n", l_possibleOverruns );
-
-	while (maj != NULL) {
-		printf( "liballoc: %x: total = %i, used = %i\n", maj, maj->size, maj->usage);
-
-		min = maj->first;
-		while (min != NULL) {
-			printf( "liballoc:    %x: %i bytes\n", min, min->size);
-			min = min->next;
-		}
-		maj = maj->next;
+	printf( "liballoc: System memory allocated: %u bytes\n", stats.allocated );
+	printf( "liballoc: Memory in used (malloc'ed): %u bytes, peak %u bytes\n", stats.inuse, stats.peak_inuse );
+	printf( "liballoc: Warning count: %u\n", stats.warnings );
+	printf( "liballoc: Error count: %u\n", stats.errors );
+	printf( "liballoc: Failed count: %u\n", stats.fail );
+	for (i = 0; i < NR_SIZE_CLASSES; ++i)
+		printf( "liballoc: %u bytes: %u allocs, %u frees\n", stats.class_size[i], stats.alloc[i], stats.free[i] );
+	for (i = 0; i < KMALLOC_LARGE_ORDERS; ++i) {
+		if (stats.large_alloc[i])
+			printf( "liballoc: order %u: %u allocs, %u frees\n", i, stats.large_alloc[i], stats.large_free[i] );
 	}
+	slab_show_statistics();
 }
 
 
 // ***************************************************************
 
-static struct liballoc_major *allocate_new_page(unsigned int size)
+/** Create the slab cache of every size class, must be called after kmem_cache_init() */
+int kmalloc_init()
 {
-	unsigned int st;
-	struct liballoc_major *maj;
-
-	// This is how much space is required.
-	st = l_pageOrder;
-	maj = (struct liballoc_major*)liballoc_alloc(st);
+	int i;
 
-	if (maj == NULL) {
-		l_warningCount += 1;
-		#if defined DEBUG || defined INFO
-		printf( "liballoc: WARNING: liballoc_alloc( %i ) return NULL\n", st );
-		FLUSH();
-		#endif
-		return NULL;	// uh oh, we ran out of memory.
+	for (i = 0; i < NR_SIZE_CLASSES; ++i) {
+		kmalloc_caches[i] = kmem_cache_create(class_name[i], class_size[i], ALIGNMENT, NULL);
+		if (kmalloc_caches[i] == NULL)
+			return -1;
 	}
+	return 0;
+}
 
-	maj->prev 	= NULL;
-	maj->next 	= NULL;
-	maj->pages 	= (1 << st);
-	maj->size 	= maj->pages * l_pageSize;
-	maj->usage 	= sizeof(struct liballoc_major);
-	maj->first 	= NULL;
-
-	l_allocated += maj->size;
-
-	#ifdef DEBUG
-	printf( "liballoc: Resource allocated %x of %i pages (%i bytes) for %i size.\n", maj, st, maj->size, size );
-
-	printf( "liballoc: Total memory usage = %i KB\n",  (int)((l_allocated / (1024))) );
-	FLUSH();
-	#endif
+/** @return: index of the smallest class that can hold size bytes, size must be in 1~MAX_CLASS_SIZE */
+static inline int size_to_class(size_t size)
+{
+	if (size <= 256)
+		return small_class_index[(size - 1) / 16];
+	/* 257~512 is class 7, 513~1024 is class 8, ... */
+	return __fls(size - 1) - 1;
+}
 
+/** @return: order of the buddy block that can hold size bytes */
+static inline int size_to_order(size_t size)
+{
+	size = (size - 1) / PAGE_SIZE;
+	return size ? __fls(size) + 1 : 0;
+}
 
-    return maj;
+/** @return: the usable size of the block, 0 if ptr was not allocated by kmalloc */
+static size_t ksize(void *ptr)
+{
+	struct kmem_cache *cache = virt_to_cache(ptr);
+	struct page *page;
+
+	if (cache)
+		return cache->size;
+	page = virt_to_page(ptr);
+	if (page_test_flag(page, PG_KMALLOC) && ((ptr_t)ptr & PAGE_MASK) == 0)
+		return PAGE_SIZE << page->order;
+	return 0;
 }
 
-void *kmalloc(size_t req_size)
+/** @caller: who asked for the block, recorded by MM_DEBUG */
+static void *__kmalloc(size_t req_size, void *caller)
 {
-	int startedBet = 0;
-	unsigned long long bestSize = 0;
 	void *p = NULL;
-	ptr_t diff;
-	struct liballoc_major *maj;
-	struct liballoc_minor *min;
-	struct liballoc_minor *new_min;
-	unsigned long size = req_size;
-    unsigned long flags;
-
-	// For alignment, we adjust size so there's enough space to align.
-	if (ALIGNMENT > 1) {
-		size += ALIGNMENT + ALIGN_INFO;
-	}
-	// So, ideally, we really want an alignment of 0 or 1 in order to save space.
-
-	liballoc_lock(&flags);
+	struct page *page;
+	unsigned long flags;
+	size_t size;
+	int order, cls = -1;
 
-	if (size == 0) {
-		l_warningCount += 1;
+	if (req_size == 0) {
+		l_stats.warnings += 1;
 		#if defined DEBUG || defined INFO
 		printf( "liballoc: WARNING: alloc( 0 ) called from %x\n",
-							__builtin_return_address(0) );
-		FLUSH();
-		#endif
-		liballoc_unlock(flags);
-		return kmalloc(1);
-	}
-
-
-	if (l_memRoot == NULL) {
-		#if defined DEBUG || defined INFO
-		#ifdef DEBUG
-		printf( "liballoc: initialization of liballoc " VERSION "\n" );
-		#endif
-		atexit( liballoc_dump );
-		FLUSH();
-		#endif
-
-		// This is the first time we are being used.
-		l_memRoot = allocate_new_page(size);
-		if (l_memRoot == NULL) {
-		  liballoc_unlock(flags);
-		  #ifdef DEBUG
-		  printf( "liballoc: initial l_memRoot initialization failed\n", p);
-		  FLUSH();
-		  #endif
-		  return NULL;
-		}
-
-		#ifdef DEBUG
-		printf( "liballoc: set up first memory major %x\n", l_memRoot );
+							caller );
 		FLUSH();
 		#endif
+		return __kmalloc(1, caller);
 	}
 
-
-	#ifdef DEBUG
-	printf( "liballoc: %x kmalloc( %i ): ",
-					__builtin_return_address(0),
-					size );
-	FLUSH();
-	#endif
-
-	// Now we need to bounce through every major and find enough space....
-
-	maj = l_memRoot;
-	startedBet = 0;
-
-	// Start at the best bet....
-	if (l_bestBet != NULL) {
-		bestSize = l_bestBet->size - l_bestBet->usage;
-
-		if (bestSize > (size + sizeof(struct liballoc_minor))) {
-			maj = l_bestBet;
-			startedBet = 1;
+	if (req_size <= MAX_CLASS_SIZE) {
+		cls = size_to_class(req_size);
+		p = kmem_cache_alloc(kmalloc_caches[cls]);
+		size = 0;
+	} else {
+		order = size_to_order(req_size);
+		if (order < MAX_ORDER)
+			p = liballoc_alloc(order);
+		if (p != NULL) {
+			page = virt_to_page(p);
+			page_set_flag(page, PG_KMALLOC);
+			page->order = order;
 		}
+		size = PAGE_SIZE << order;
 	}
 
-	while (maj != NULL) {
-		diff  = maj->size - maj->usage;
-										// free memory in the block
-
-		if (bestSize < diff) {
-			// Hmm.. this one has more memory then our bestBet. Remember!
-			l_bestBet = maj;
-			bestSize = diff;
-		}
-
-
-#ifdef USE_CASE1
-
-	// CASE 1:  There is not enough space in this major block.
-	if (diff < (size + sizeof(struct liballoc_minor))) {
-		#ifdef DEBUG
-		printf( "CASE 1: Insufficient space in block %x\n", maj);
+	if (p == NULL) {
+		l_stats.fail += 1;
+		#if defined DEBUG || defined INFO
+		printf( "liballoc: WARNING: kmalloc( %i ) returning NULL.\n", req_size);
 		FLUSH();
 		#endif
-
-		// Another major block next to this one?
-		if (maj->next != NULL) {
-			maj = maj->next;		// Hop to that one.
-			continue;
-		}
-
-		if ( startedBet == 1 ) {
-            // If we started at the best bet, let's start all over again.
-			maj = l_memRoot;
-			startedBet = 0;
-			continue;
-		}
-
-		// Create a new major block next to this one and...
-		maj->next = allocate_new_page( size );	// next one will be okay.
-		if (maj->next == NULL) break;			// no more memory.
-		maj->next->prev = maj;
-		maj = maj->next;
-		// .. fall through to CASE 2 ..
+		return NULL;
 	}
 
-#endif
-
-#ifdef USE_CASE2
-
-		// CASE 2: It's a brand new block.
-		if (maj->first == NULL) {
-			maj->first = (struct liballoc_minor*)((ptr_t)maj + sizeof(struct liballoc_major) );
-			maj->first->magic 		= LIBALLOC_MAGIC;
-			maj->first->prev 		= NULL;
-			maj->first->next 		= NULL;
-			maj->first->block 		= maj;
-			maj->first->size 		= size;
-			maj->first->req_size 	= req_size;
-			maj->usage 	+= size + sizeof( struct liballoc_minor );
-			l_inuse += size;
-
-			p = (void*)((ptr_t)(maj->first) + sizeof( struct liballoc_minor ));
-			ALIGN(p);
-
-			#ifdef DEBUG
-			printf( "CASE 2: returning %x\n", p);
-			FLUSH();
-			#endif
-			liballoc_unlock(flags);		// release the lock
-			return p;
-		}
-
-#endif
-
-#ifdef USE_CASE3
-
-	// CASE 3: Block in use and enough space at the start of the block.
-	diff = (ptr_t)(maj->first);
-	diff -= (ptr_t)maj;
-	diff -= sizeof(struct liballoc_major);
-
-	if (diff >= (size + sizeof(struct liballoc_minor))) {
-		// Yes, space in front. Squeeze in.
-		maj->first->prev = (struct liballoc_minor*)((ptr_t)maj + sizeof(struct liballoc_major));
-		maj->first->prev->next = maj->first;
-		maj->first = maj->first->prev;
-		maj->first->magic = LIBALLOC_MAGIC;
-		maj->first->prev = NULL;
-		maj->first->block = maj;
-		maj->first->size = size;
-		maj->first->req_size = req_size;
-		maj->usage += size + sizeof(struct liballoc_minor);
-
-		l_inuse += size;
-		p = (void*)((ptr_t)(maj->first) + sizeof( struct liballoc_minor ));
-		ALIGN(p);
-
-		#ifdef DEBUG
-		printf( "CASE 3: returning %x\n", p);
-		FLUSH();
-		#endif
-		liballoc_unlock(flags);		// release the lock
-		return p;
-	}
+	liballoc_lock(&flags);
+	if (cls >= 0)
+		l_stats.alloc[cls]++;
+	else
+		l_stats.large_alloc[order]++;
+	l_allocated += size;
+	l_stats.inuse += ksize(p);
+	if (l_stats.inuse > l_stats.peak_inuse)
+		l_stats.peak_inuse = l_stats.inuse;
+	liballoc_unlock(flags);
 
-#endif
-
-
-#ifdef USE_CASE4
-
-	// CASE 4: There is enough space in this block. But is it contiguous?
-	min = maj->first;
-
-		// Looping within the block now...
-	while (min != NULL) {
-		// CASE 4.1: End of minors in a block. Space from last and end?
-		if (min->next == NULL) {
-			// the rest of this block is free...  is it big enough?
-			diff = (ptr_t)(maj) + maj->size;
-			diff -= (ptr_t)min;
-			diff -= sizeof( struct liballoc_minor );
-			diff -= min->size;
-			// minus already existing usage..
-
-			if (diff >= (size + sizeof(struct liballoc_minor))) {
-				// yay....
-				min->next = (struct liballoc_minor*)((ptr_t)min + sizeof(struct liballoc_minor) + min->size);
-				min->next->prev = min;
-				min = min->next;
-				min->next = NULL;
-				min->magic = LIBALLOC_MAGIC;
-				min->block = maj;
-				min->size = size;
-				min->req_size = req_size;
-				maj->usage += size + sizeof( struct liballoc_minor );
-
-				l_inuse += size;
-				p = (void*)((ptr_t)min + sizeof( struct liballoc_minor ));
-				ALIGN(p);
-
-				#ifdef DEBUG
-				printf( "CASE 4.1: returning %x\n", p);
-				FLUSH();
-				#endif
-				liballoc_unlock(flags);		// release the lock
-				return p;
-			}
-		}
+	mm_debug_alloc(MM_DEBUG_KMALLOC, p, ksize(p), caller);
+	return p;
+}
 
+void *kmalloc(size_t req_size)
+{
+	return __kmalloc(req_size, __builtin_return_address(0));
+}
 
+/** Give the block back to slab or buddy system, after it leaves quarantine if MM_DEBUG is set. */
+static void kfree_release(void *ptr, uint32_t size)
+{
+	struct kmem_cache *cache = virt_to_cache(ptr);
+	struct page *page;
 
-		// CASE 4.2: Is there space between two minors?
-		if (min->next != NULL) {
-			// is the difference between here and next big enough?
-			diff  = (ptr_t)(min->next);
-			diff -= (ptr_t)min;
-			diff -= sizeof(struct liballoc_minor);
-			diff -= min->size;
-								// minus our existing usage.
-
-			if (diff >= (size + sizeof(struct liballoc_minor))) {
-				// yay......
-				new_min = (struct liballoc_minor*)((ptr_t)min + sizeof(struct liballoc_minor) + min->size);
-
-				new_min->magic = LIBALLOC_MAGIC;
-				new_min->next = min->next;
-				new_min->prev = min;
-				new_min->size = size;
-				new_min->req_size = req_size;
-				new_min->block = maj;
-				min->next->prev = new_min;
-				min->next = new_min;
-				maj->usage += size + sizeof( struct liballoc_minor );
-
-				l_inuse += size;
-
-				p = (void*)((ptr_t)new_min + sizeof( struct liballoc_minor ));
-				ALIGN( p );
-
-				#ifdef DEBUG
-				printf( "CASE 4.2: returning %x\n", p);
-				FLUSH();
-				#endif
-
-				liballoc_unlock(flags);		// release the lock
-				return p;
-			}
-		}	// min->next != NULL
-
-		min = min->next;
-	} // while min != NULL ...
-#endif
-
-#ifdef USE_CASE5
-	    // CASE 5: Block full! Ensure next block and loop.
-	    if (maj->next == NULL) {
-	    	#ifdef DEBUG
-	    	printf( "CASE 5: block full\n");
-	    	FLUSH();
-	    	#endif
-
-	    	if (startedBet == 1) {
-	    		maj = l_memRoot;
-	    		startedBet = 0;
-	    		continue;
-	    	}
-
-	    	// we've run out. we need more...
-	    	maj->next = allocate_new_page(size);		// next one guaranteed to be okay
-	    	if (maj->next == NULL) break;			//  uh oh,  no more memory.....
-	    	maj->next->prev = maj;
-	    }
-#endif
-
-	    maj = maj->next;
-	} // while (maj != NULL)
-
-
-
-	liballoc_unlock(flags);		// release the lock
-
-	printf( "liballoc: WARNING: kmalloc( %i ) returning NULL.\n", size);
-	liballoc_dump();
-	return NULL;
+	if (cache) {
+		kmem_cache_free(cache, ptr);
+	} else {
+		page = virt_to_page(ptr);
+		page_clear_flag(page, PG_KMALLOC);
+		liballoc_free(ptr, 1 << page->order);
+	}
 }
 
-void kfree(void *ptr)
+static void __kfree(void *ptr, void *caller)
 {
-	struct liballoc_minor *min;
-	struct liballoc_major *maj;
-    unsigned long flags;
+	struct kmem_cache *cache;
+	struct page *page;
+	unsigned long flags;
+	size_t size;
 
 	if (ptr == NULL) {
-		l_warningCount += 1;
+		l_stats.warnings += 1;
 		#if defined DEBUG || defined INFO
 		printf( "liballoc: WARNING: kfree( NULL ) called from %x\n",
-							__builtin_return_address(0) );
+							caller );
 		FLUSH();
 		#endif
 		return;
 	}
 
-	UNALIGN(ptr);
-	liballoc_lock(&flags);		// lockit
-	min = (struct liballoc_minor*)((ptr_t)ptr - sizeof( struct liballoc_minor));
-
-	if (min->magic != LIBALLOC_MAGIC) {
-		l_errorCount += 1;
-
-		// Check for overrun errors. For all bytes of LIBALLOC_MAGIC
-		if (((min->magic & 0xFFFFFF) == (LIBALLOC_MAGIC & 0xFFFFFF)) ||
-			((min->magic & 0xFFFF) == (LIBALLOC_MAGIC & 0xFFFF)) ||
-			((min->magic & 0xFF) == (LIBALLOC_MAGIC & 0xFF))) {
-			l_possibleOverruns += 1;
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: Possible 1-3 byte overrun for magic %x != %x\n",
-								min->magic,
-								LIBALLOC_MAGIC );
-			FLUSH();
-			#endif
-		}
-
-
-		if (min->magic == LIBALLOC_DEAD) {
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: multiple kfree() attempt on %x from %x.\n",
-									ptr,
-									__builtin_return_address(0) );
-			FLUSH();
-			#endif
-		} else {
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: Bad kfree( %x ) called from %x\n",
-								ptr,
-								__builtin_return_address(0) );
-			FLUSH();
-			#endif
-		}
-
-		// being lied to...
-		liballoc_unlock(flags);		// release the lock
+	size = ksize(ptr);
+	if (size == 0) {
+		l_stats.errors += 1;
+		#if defined DEBUG || defined INFO
+		printf( "liballoc: ERROR: Bad kfree( %x ) called from %x\n",
+							ptr,
+							caller );
+		FLUSH();
+		#endif
 		return;
 	}
 
-	#ifdef DEBUG
-	printf( "liballoc: %x kfree( %x ): ",
-				__builtin_return_address( 0 ),
-				ptr );
-	FLUSH();
-	#endif
-
-
-	maj = min->block;
-
-	l_inuse -= min->size;
-
-	maj->usage -= (min->size + sizeof(struct liballoc_minor));
-	min->magic  = LIBALLOC_DEAD;		// No mojo.
-
-	if (min->next != NULL) min->next->prev = min->prev;
-	if (min->prev != NULL) min->prev->next = min->next;
-
-	if (min->prev == NULL) maj->first = min->next;
-	// Might empty the block. This was the first minor.
-
-	// We need to clean up after the majors now....
-	if (maj->first == NULL)	 {// Block completely unused.
-		if (l_memRoot == maj) l_memRoot = maj->next;
-		if (l_bestBet == maj) l_bestBet = NULL;
-		if (maj->prev != NULL) maj->prev->next = maj->next;
-		if (maj->next != NULL) maj->next->prev = maj->prev;
-		l_allocated -= maj->size;
-
-		liballoc_free(maj, maj->pages);
+	cache = virt_to_cache(ptr);
+	page = virt_to_page(ptr);
+	liballoc_lock(&flags);
+	l_stats.inuse -= size;
+	if (cache) {
+		l_stats.free[size_to_class(size)]++;
 	} else {
-		if (l_bestBet != NULL) {
-			int bestSize = l_bestBet->size  - l_bestBet->usage;
-			int majSize = maj->size - maj->usage;
-
-			if (majSize > bestSize) l_bestBet = maj;
-		}
-
+		l_stats.large_free[page->order]++;
+		l_allocated -= size;
 	}
-	#ifdef DEBUG
-	printf( "OK\n");
-	FLUSH();
-	#endif
+	liballoc_unlock(flags);
+
+	if (mm_debug_free(MM_DEBUG_KMALLOC, ptr, size, caller, kfree_release))
+		return;
+	kfree_release(ptr, size);
+}
 
-	liballoc_unlock(flags);		// release the lock
+void kfree(void *ptr)
+{
+	__kfree(ptr, __builtin_return_address(0));
 }
 
 void* kcalloc(size_t nobj, size_t size)
@@ -604,8 +295,9 @@ void* kcalloc(size_t nobj, size_t size)
 
     real_size = nobj * size;
 
-    p = kmalloc(real_size);
-    liballoc_memset(p, 0, real_size);
+    p = __kmalloc(real_size, __builtin_return_address(0));
+    if (p != NULL)
+        liballoc_memset(p, 0, real_size);
 
     return p;
 }
@@ -613,80 +305,39 @@ void* kcalloc(size_t nobj, size_t size)
 void* krealloc(void *p, size_t size)
 {
 	void *ptr;
-	struct liballoc_minor *min;
-	unsigned int real_size;
-    unsigned long flags;
+	size_t real_size;
 
 	// Honour the case of size == 0 => free old and return NULL
 	if (size == 0) {
-		kfree(p);
+		__kfree(p, __builtin_return_address(0));
 		return NULL;
 	}
 
 	// In the case of a NULL pointer, return a simple malloc.
-	if (p == NULL) return kmalloc(size);
-
-	// Unalign the pointer if required.
-	ptr = p;
-	UNALIGN(ptr);
-
-	liballoc_lock(&flags);		// lockit
-
-	min = (struct liballoc_minor*)((ptr_t)ptr - sizeof( struct liballoc_minor ));
-
-	// Ensure it is a valid structure.
-	if (min->magic != LIBALLOC_MAGIC) {
-		l_errorCount += 1;
-
-		// Check for overrun errors. For all bytes of LIBALLOC_MAGIC
-		if (((min->magic & 0xFFFFFF) == (LIBALLOC_MAGIC & 0xFFFFFF)) ||
-			((min->magic & 0xFFFF) == (LIBALLOC_MAGIC & 0xFFFF)) ||
-			((min->magic & 0xFF) == (LIBALLOC_MAGIC & 0xFF))) {
-			l_possibleOverruns += 1;
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: Possible 1-3 byte overrun for magic %x != %x\n",
-								min->magic,
-								LIBALLOC_MAGIC );
-			FLUSH();
-			#endif
-		}
-		if (min->magic == LIBALLOC_DEAD) {
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: multiple kfree() attempt on %x from %x.\n",
-									ptr,
-									__builtin_return_address(0) );
-			FLUSH();
-			#endif
-		} else {
-			#if defined DEBUG || defined INFO
-			printf( "liballoc: ERROR: Bad kfree( %x ) called from %x\n",
-								ptr,
-								__builtin_return_address(0) );
-			FLUSH();
-			#endif
-		}
+	if (p == NULL) return __kmalloc(size, __builtin_return_address(0));
 
-		// being lied to...
-		liballoc_unlock(flags);		// release the lock
+	real_size = ksize(p);
+	if (real_size == 0) {
+		l_stats.errors += 1;
+		#if defined DEBUG || defined INFO
+		printf( "liballoc: ERROR: Bad krealloc( %x ) called from %x\n",
+							p,
+							__builtin_return_address(0) );
+		FLUSH();
+		#endif
 		return NULL;
 	}
 
-	// Definitely a memory block.
-
-	real_size = min->req_size;
-
-	if (real_size >= size) {
-		min->req_size = size;
-		liballoc_unlock(flags);
+	// The block is big enough already.
+	if (real_size >= size)
 		return p;
-	}
-
-	liballoc_unlock(flags);
 
 	// If we got here then we're reallocating to a block bigger than us.
-	ptr = kmalloc(size);					// We need to allocate new memory
+	ptr = __kmalloc(size, __builtin_return_address(0));	// We need to allocate new memory
+	if (ptr == NULL)
+		return NULL;
 	liballoc_memcpy(ptr, p, real_size);
-	kfree(p);
+	__kfree(p, __builtin_return_address(0));
 
 	return ptr;
-}
\ No newline at end of file
+}
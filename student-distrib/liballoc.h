@@ -43,6 +43,35 @@ extern void* liballoc_alloc(size_t);
 extern void liballoc_free(void*,size_t);
 
 
+/** Set up size classes of kmalloc, slab allocator must be ready.
+ *
+ * \return 0 if success.
+ */
+extern int kmalloc_init();
+
+/** Print allocated memory and slab caches of every size class. */
+extern void liballoc_dump();
+
+#define KMALLOC_NR_CLASSES		10
+#define KMALLOC_LARGE_ORDERS	11		///< Same as MAX_ORDER of buddy system, mm.h includes this file.
+
+/** Counters of kmalloc since boot, see kmalloc_get_stats(). */
+struct kmalloc_stats {
+	uint32_t class_size[KMALLOC_NR_CLASSES];
+	uint32_t alloc[KMALLOC_NR_CLASSES];			///< Histogram of small requests by size class.
+	uint32_t free[KMALLOC_NR_CLASSES];
+	uint32_t large_alloc[KMALLOC_LARGE_ORDERS];	///< Histogram of large requests by order of the block.
+	uint32_t large_free[KMALLOC_LARGE_ORDERS];
+	uint32_t fail;
+	uint32_t allocated;		///< Bytes of slabs of size classes and large blocks.
+	uint32_t inuse;			///< Usable bytes of blocks not freed yet.
+	uint32_t peak_inuse;
+	uint32_t warnings;
+	uint32_t errors;
+};
+
+extern void kmalloc_get_stats(struct kmalloc_stats *stats);
+
 extern void    *kmalloc(size_t);				///< The standard function.
 extern void    *krealloc(void *, size_t);		///< The standard function.
 extern void    *kcalloc(size_t, size_t);		///< The standard function.
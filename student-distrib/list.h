@@ -49,6 +49,20 @@ static inline void list_del(struct list *v)
     v->next = NULL;
 }
 
+/* Move all entries of old to new, old becomes empty */
+static inline void list_replace_init(struct list *old, struct list *new)
+{
+    if (list_empty(old)) {
+        INIT_LIST(new);
+        return;
+    }
+    WRITE_ONCE(new->next, old->next);
+    WRITE_ONCE(new->prev, old->prev);
+    WRITE_ONCE(new->next->prev, new);
+    WRITE_ONCE(new->prev->next, new);
+    INIT_LIST(old);
+}
+
 static inline int list_is_head(struct list *l1, struct list *l2)
 {
     return l1 == l2;
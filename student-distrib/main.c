@@ -20,14 +20,6 @@
 extern void timer_handler();
 char init_finish = 0;
 
-#define APIC_LOCAL_TIMER_ONESHOT_MODE  (0)
-#define APIC_LOCAL_TIMER_PERIODIC_MODE (1 << 17)
-#define APIC_LOCAL_TIMER_TSCDDL_MODE   (2 << 17)
-#define APIC_LOCAL_TIMER_DELIVERT_IDLE (0)
-#define APIC_LOCAL_TIMER_DELIVERT_PENDING (1 << 11)
-
-#define LOCAL_APIC_TIMER 0xbf
-
 static bool detect_apic()
 {
         uint32_t regs[4] = {0};
@@ -116,15 +108,16 @@ void entry(unsigned long magic, unsigned long addr)
     enable_paging();
     if (launch_tests() == false)
         panic("test failed\n");
-    enable_irq(PIC_TIMER_INTR);
+    if (init_clockevents())
+        panic("clockevents init failed\n");
     /* if (test_tasks()) {
         KERN_INFO("schedule init failed\n");
         return;
     } */
     sti();
 
-    /* Enable paging */
-    while (1) ;
+    /* the boot task becomes the idle task */
+    cpu_idle();
 
     /* Initialize devices, memory, filesystem, enable device interrupts on the
      * PIC, any other initialization stuff... */
@@ -6,6 +6,12 @@
 #include "types.h"
 #include "vga.h"
 #include "list.h"
+#include "bitops.h"
+#include "smp.h"
+#include "intr.h"
+#include "slab.h"
+#include "mm_debug.h"
+#include "timer.h"
 
 extern const int __text_start;
 extern const int __text_end;
@@ -30,65 +36,169 @@ extern const int __kernel_end;
  *  According to Chapter 4.1.1 intel manual volume 3, there are four paging modes, we use the first mode (32-bit paging),
  *  which means that CR0.PG=1 && CR4.PAE=0. We don't need PCID(which used for tlb cache between multi user processes)
  *  and protection key, and we doesn't support 48bit phy addr, so there is no need to use 4-level and 5-level paging.
- * @TODO: Currently we disabled 4MB page. Support it in future.
+ *  Physical memory above 4MB is identity mapped by 4MB pages(CR4.PSE=1, pde with PS_BIT), see page_table_init().
 */
 
 /* @NOTE: about mem_bitmap
- *   Currently we use 16k memory used for memory bitmap, every bit represents PAGE_SIZE memory.
- *   mem_bitmap was stored in bss section, because uninited global variable was stored in bss section.
+ *   Every bit represents PAGE_SIZE memory, one bit per pfn from 0 to max_pfn.
+ *   mem_bitmap, mem_map and free area bitmaps are sized from multiboot memory map when boot and allocated from
+ *   memblock, see alloc_mm_metadata().
+ *   So the amount of memory we can manage is not decided at compile time.
  * @TODO: bitmap has heavy external memory fragment problem, use buddy system to resolve it.
- * @WARN: when memory is larger than 512MB, SLOTS MUST be larger, otherwise unexpected memory overwritten
-          will happen.
  */
-uint8_t mem_bitmap[SLOTS];
+uint8_t *mem_bitmap;
 #define BITS_IN_SLOT (sizeof(mem_bitmap[0])*8)
-uint64_t phy_mem_base;
-uint64_t phy_mem_len;
-uint64_t phy_mem_end;
+
+/* @NOTE: about mem_map
+ *   Every page frame that mem_bitmap covers has a struct page in mem_map, indexed by pfn.
+ *   Buddy system uses it to know whether a page is the head of a free block and the order of that block,
+ *   so checking if buddy is free is O(1) instead of scanning bits in mem_bitmap.
+ */
+struct page *mem_map;
+pfn_t max_pfn;  // pfn of the first page beyond managed memory
 pgd_t *init_pgtbl_dir;
+struct mm init_mm;  // address space of kernel, it has no user area
+static struct kmem_cache *mm_cachep;
+static struct kmem_cache *vma_cachep;
+
+/* @NOTE: about memory regions
+ *   Every usable(type 1) entry of multiboot memory map becomes a mem_region. All regions share one pfn space
+ *   (pfn = physical address / PAGE_SIZE), pages in the holes between them are marked as used in mem_bitmap and
+ *   never become free, so buddy blocks never cross a hole. Physical address above FIXADDR_START is ignored since
+ *   it can't be identity mapped.
+ */
+#define MAX_MEM_REGIONS 8
+
+struct mem_region {
+    unsigned long base;     // page aligned
+    unsigned long end;      // page aligned, not included
+    uint32_t nr_pages;
+    uint32_t nr_reserved;   // pages used by kernel, stack, multiboot data... when boot
+    uint32_t nr_free;
+};
 
+static struct mem_region mem_regions[MAX_MEM_REGIONS];
+static int nr_mem_regions;
+
+/* @NOTE: about free area bitmaps
+ *   free_area_map[order] has one bit per (1 << order) aligned block, the bit is set when that block is a free block
+ *   of exactly this order. free_area_summary of a zone has bit order set when its free list of order is not empty.
+ *   So alloc_pages finds the smallest usable order with one bsf, and buddy checking only tests one bit
+ *   in a dense array instead of touching mem_map or list memory.
+ */
 struct free_mem_stcutre {
     struct list free_pages_head[MAX_ORDER];
     uint32_t nr_free_pages[MAX_ORDER];
+    uint32_t free_area_summary;
 
     uint32_t all_free_pages;
+    uint32_t zeroed_free_pages;
+};
+
+/* shared by all zones, since they are indexed by pfn */
+static uint32_t *free_area_map[MAX_ORDER];
+
+/*
+ * Zone boundaries are multiples of the largest block size, so a buddy block never crosses them and free blocks
+ * only merge with blocks of the same zone.
+ * An allocation falling back to a lower zone has to leave lowmem_reserve pages there besides the watermark, so
+ * ordinary allocations don't use up ZONE_DMA which only some devices need, see get_page_from_zones().
+ */
+#define LOWMEM_RESERVE_RATIO 256    // reserve 1/256 of the pages of higher zones, at most half of the zone
+
+struct zone {
+    const char *name;
+    pfn_t start_pfn;
+    pfn_t end_pfn;              // not included
+    uint32_t managed_pages;     // pages handed to buddy system at boot
+    uint32_t watermark[NR_WMARK];
+    uint32_t watermark_boost;   // added to all watermarks, see set_watermark_boost()
+    uint32_t lowmem_reserve;
+    struct free_mem_stcutre free_area;
+};
+
+static struct zone zones[NR_ZONES] = {
+    { "DMA", 0, MAX_DMA_ADDRESS / PAGE_SIZE },
+    { "Normal", MAX_DMA_ADDRESS / PAGE_SIZE, (pfn_t)-1 },
+};
+static struct buddy_stats buddy_stats;  // only counters are kept here, the rest is filled by mm_get_stats()
+
+/*
+ * @NOTE: about memory pressure
+ *   Watermarks of a zone are set from its free pages at boot: min is 1/256 of them(at least 32 pages but no more
+ *   than a quarter of the zone, at most 4M), low and high are 5/4 and 3/2 of min. An allocation which would leave
+ *   fewer free pages than low, counting only blocks large enough for its order, takes the slow path: shrinkers are
+ *   asked to give back enough pages to reach high, so that the following allocations take the fast path again, and
+ *   a failed request retries as long as shrinkers make progress. So the kernel runs out of memory only when no
+ *   cache has anything left to give.
+ */
+#define MIN_WMARK_PAGES     32
+#define MAX_WMARK_PAGES     (1 << _MAX_ORDER)
+#define MAX_RECLAIM_RETRIES 3
+
+static struct list shrinkers = { &shrinkers, &shrinkers };
+
+/* @NOTE: about per cpu pages
+ *   Order-0 pages are requested very often (page tables, mm, ...), so every cpu caches some of them in front of
+ *   buddy system. alloc_page/free_page only pop/push the list of local cpu, which needs no lock but disabling local
+ *   interrupts. When the cache is empty, batch pages are moved from buddy system in one go; when it holds more than
+ *   high pages, batch cold pages are given back.
+ *   Hot pages(recently freed, likely still in cpu cache) are at the head of list, cold pages are at the tail.
+ */
+#define PCP_HIGH  64
+#define PCP_BATCH 16
+
+struct per_cpu_pages {
+    struct list list;
+    uint32_t count;
+    uint32_t high;
+    uint32_t batch;
+
+    uint32_t hit;
+    uint32_t miss;
 };
 
-static struct free_mem_stcutre phy_mm_stcutre;
+static struct per_cpu_pages pcp_pages[NR_CPUS];
 
-static inline struct list* get_free_pages_head(char order)
+static inline struct per_cpu_pages* this_cpu_pcp()
 {
-    return &phy_mm_stcutre.free_pages_head[order];
+    return &pcp_pages[smp_processor_id()];
 }
 
-/* @NOTE: caller must hold mm lock */
-#define ITERATE_PAGES(free_statements, used_statements)     \
-    int __cur_slot, __cur_bit;                                         \
-    int ___nr_slots = ((phy_mem_len / PAGE_SIZE) + BITS_IN_SLOT)/BITS_IN_SLOT;  \
-    for (__cur_slot = 0; __cur_slot < ___nr_slots; ++__cur_slot) {    \
-        /* every bit in uint8 */                   \
-        for (__cur_bit = 0; __cur_bit < BITS_IN_SLOT; ++__cur_bit) {         \
-            /* See if bit __cur_bit was set.*/                               \
-            if (!(mem_bitmap[__cur_slot] & (1 << __cur_bit))) {              \
-                free_statements;                                                                    \
-            } else {                                                                                \
-                used_statements;                                                                    \
-            }                                                                                       \
-        }                                                                                           \
-    }                                                                                               \
-
-
-/* only alloc 4k size memory, used for alloc page table */
-void* alloc_pgdir()
+static uint32_t *free_area_bits;
+static uint32_t free_area_longs;
+
+static inline struct list* get_free_pages_head(struct zone *zone, char order)
+{
+    return &zone->free_area.free_pages_head[order];
+}
+
+static inline uint32_t wmark_pages(struct zone *zone, int wmark)
+{
+    return zone->watermark[wmark] + zone->watermark_boost;
+}
+
+static inline struct zone* pfn_to_zone(pfn_t pfn)
+{
+    return pfn < zones[ZONE_NORMAL].start_pfn ? &zones[ZONE_DMA] : &zones[ZONE_NORMAL];
+}
+
+/* @return: the zone an allocation of gfp tries first */
+static inline struct zone* gfp_zone(gfp_t gfp)
 {
-    return alloc_page();
+    return (gfp & __GFP_DMA) ? &zones[ZONE_DMA] : &zones[ZONE_NORMAL];
+}
+
+static inline struct page* pfn_to_struct_page(pfn_t pfn)
+{
+    return &mem_map[pfn];
 }
 
 /* Get the slot and bit which addr belongs to */
 void page_bitmap_get_location(unsigned long addr, int *ret_slot, int *ret_bit)
 {
-    *ret_slot = (addr - phy_mem_base)/PAGE_SIZE/BITS_IN_SLOT;
-    *ret_bit = ((addr - phy_mem_base)/PAGE_SIZE)%BITS_IN_SLOT;
+    *ret_slot = addr/PAGE_SIZE/BITS_IN_SLOT;
+    *ret_bit = (addr/PAGE_SIZE)%BITS_IN_SLOT;
 }
 
 static inline void __page_bitmap_set(unsigned long addr, int slot, int bit)
@@ -127,100 +237,280 @@ void page_bitmap_set_free(void *addr, char order)
     page_bitmap_set(addr, order, 0);
 }
 
+static inline bool page_bitmap_is_busy(unsigned long addr)
+{
+    int slot, bit;
+
+    page_bitmap_get_location(addr, &slot, &bit);
+    return CHECK_FLAG(mem_bitmap[slot], bit) != 0;
+}
+
+static inline void __page_bitmap_set_bit(pfn_t pfn, bool busy)
+{
+    if (busy)
+        mem_bitmap[pfn / BITS_IN_SLOT] |= (1 << (pfn % BITS_IN_SLOT));
+    else
+        mem_bitmap[pfn / BITS_IN_SLOT] &= ~(1 << (pfn % BITS_IN_SLOT));
+}
+
+/*
+ * @NOTE: about memblock
+ *   Before buddy system is up, memory is handed out by memblock, a bump allocator over the memory regions.
+ *   memblock.reserved records every byte range in use: kernel, boot stack, data passed by bootloader and what
+ *   memblock_alloc() returned. memblock_alloc() takes the first free range above its cursor, so allocations are
+ *   adjacent and merge into one reserved range. mm metadata and the page tables of identity mapping come from here.
+ *   init_free_pages_list() closes memblock, then every page that doesn't overlap a reserved range goes to buddy
+ *   system. Memory allocated from memblock is never freed.
+ */
+#define MAX_MEMBLOCK_RESERVED 32
+
+struct memblock_range {
+    unsigned long start;
+    unsigned long end;      // not included
+};
+
+static struct {
+    struct memblock_range reserved[MAX_MEMBLOCK_RESERVED];
+    int nr_reserved;
+    unsigned long cursor;   // memblock_alloc() never goes below it
+    uint32_t allocated;     // bytes returned by memblock_alloc()
+    bool closed;
+} memblock;
+
+/* Record [start, end) as used, it's merged with the reserved range it overlaps or touches */
+static void memblock_reserve(unsigned long start, unsigned long end)
+{
+    struct memblock_range *range;
+    int i;
+
+    if (end <= start)
+        return;
+    for (i = 0; i < memblock.nr_reserved; ++i) {
+        range = &memblock.reserved[i];
+        if (start <= range->end && range->start <= end) {
+            range->start = start < range->start ? start : range->start;
+            range->end = end > range->end ? end : range->end;
+            return;
+        }
+    }
+    panic_on(memblock.nr_reserved == MAX_MEMBLOCK_RESERVED, "too many memblock reserved ranges\n");
+    memblock.reserved[memblock.nr_reserved].start = start;
+    memblock.reserved[memblock.nr_reserved].end = end;
+    memblock.nr_reserved++;
+}
+
+/* @return: the end of the reserved range which overlaps with [start, end), or 0 if not overlapped */
+static unsigned long memblock_overlap(unsigned long start, unsigned long end)
+{
+    int i;
+
+    for (i = 0; i < memblock.nr_reserved; ++i) {
+        if (start < memblock.reserved[i].end && memblock.reserved[i].start < end)
+            return memblock.reserved[i].end;
+    }
+    return 0;
+}
+
+/*
+ * Get size bytes of zeroed memory aligned to align(power of 2) before buddy system is up. The memory is above the
+ * kernel, so page_table_init() identity maps it.
+ * @return: NULL if there is no memory
+ */
+static void* memblock_alloc(uint32_t size, uint32_t align)
+{
+    unsigned long start, overlap_end;
+    int i;
+
+    panic_on(memblock.closed, "memblock_alloc after buddy system is up\n");
+    for (i = 0; i < nr_mem_regions; ++i) {
+        start = mem_regions[i].base;
+        if (start < memblock.cursor)
+            start = memblock.cursor;
+        start = (start + align - 1) & ~(align - 1);
+        while (start < mem_regions[i].end && mem_regions[i].end - start >= size) {
+            overlap_end = memblock_overlap(start, start + size);
+            if (!overlap_end) {
+                memblock_reserve(start, start + size);
+                memblock.cursor = start + size;
+                memblock.allocated += size;
+                memset((void*)start, 0, size);
+                return (void*)start;
+            }
+            start = (overlap_end + align - 1) & ~(align - 1);
+        }
+    }
+    return NULL;
+}
+
+/* only alloc 4k size memory, used for alloc page table. Page tables of identity mapping come from memblock */
+void* alloc_pgdir()
+{
+    if (!memblock.closed)
+        return memblock_alloc(PAGE_SIZE, PAGE_SIZE);
+    return alloc_pages_zeroed(0);
+}
+
+/* Set bits of pfn in [start, end) to busy or free, whole bytes are filled by memset */
+static void page_bitmap_set_range(pfn_t start, pfn_t end, bool busy)
+{
+    if (end > max_pfn)
+        end = max_pfn;
+    if (start >= end)
+        return;
+    for (; start < end && start % BITS_IN_SLOT; ++start)
+        __page_bitmap_set_bit(start, busy);
+    if (end - start >= BITS_IN_SLOT) {
+        memset(&mem_bitmap[start / BITS_IN_SLOT], busy ? 0xff : 0, (end - start) / BITS_IN_SLOT);
+        start += (end - start) / BITS_IN_SLOT * BITS_IN_SLOT;
+    }
+    for (; start < end; ++start)
+        __page_bitmap_set_bit(start, busy);
+}
+
+static void add_mem_region(uint64_t base, uint64_t len)
+{
+    uint64_t end = base + len;
+    struct mem_region *region;
+
+    /* memory above FIXADDR_START can't be identity mapped */
+    if (base >= FIXADDR_START)
+        return;
+    if (end > FIXADDR_START)
+        end = FIXADDR_START;
+    base = (base + PAGE_MASK) & ~((uint64_t)PAGE_MASK);
+    end &= ~((uint64_t)PAGE_MASK);
+    if (end <= base)
+        return;
+
+    /* adjacent entries are merged into one region */
+    if (nr_mem_regions && mem_regions[nr_mem_regions-1].end == base) {
+        mem_regions[nr_mem_regions-1].end = end;
+    } else {
+        if (nr_mem_regions == MAX_MEM_REGIONS) {
+            KERN_INFO("WARNING: too many memory regions, ignore 0x%x-0x%x\n", (unsigned long)base, (unsigned long)end);
+            return;
+        }
+        region = &mem_regions[nr_mem_regions++];
+        memset(region, 0, sizeof(*region));
+        region->base = base;
+        region->end = end;
+    }
+    region = &mem_regions[nr_mem_regions-1];
+    region->nr_pages = (region->end - region->base) / PAGE_SIZE;
+    if (region->end / PAGE_SIZE > max_pfn)
+        max_pfn = region->end / PAGE_SIZE;
+}
+
+/* Memory which bootloader passed to us must not be used until we don't need them */
+static void reserve_multiboot_info(multiboot_info_t *mbi)
+{
+    memblock_reserve((unsigned long)mbi, (unsigned long)mbi + sizeof(*mbi));
+    if (CHECK_FLAG(mbi->flags, 2))
+        memblock_reserve(mbi->cmdline, mbi->cmdline + strlen((int8_t*)mbi->cmdline) + 1);
+    if (CHECK_FLAG(mbi->flags, 3)) {
+        module_t *mod = (module_t*)mbi->mods_addr;
+        uint32_t i;
+
+        memblock_reserve(mbi->mods_addr, mbi->mods_addr + mbi->mods_count * sizeof(module_t));
+        for (i = 0; i < mbi->mods_count; ++i, ++mod)
+            memblock_reserve(mod->mod_start, mod->mod_end);
+    }
+    if (CHECK_FLAG(mbi->flags, 6))
+        memblock_reserve(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length);
+}
+
+/*
+ * Allocate mem_bitmap, mem_map and free area bitmaps from memblock, their sizes depend on max_pfn.
+ * @return: total bytes of metadata, or 0 if there is no memory for them
+ */
+static uint32_t alloc_mm_metadata()
+{
+    uint32_t bitmap_size, map_size, area_size;
+    int i;
+
+    bitmap_size = ((max_pfn + BITS_PER_LONG) / BITS_PER_LONG) * sizeof(uint32_t);
+    map_size = max_pfn * sizeof(struct page);
+    free_area_longs = 0;
+    for (i = 0; i < MAX_ORDER; ++i)
+        free_area_longs += BITS_TO_LONGS((max_pfn >> i) + 1);
+    area_size = free_area_longs * sizeof(uint32_t);
+
+    mem_bitmap = memblock_alloc(bitmap_size, sizeof(uint32_t));
+    mem_map = memblock_alloc(map_size, sizeof(uint32_t));
+    free_area_bits = memblock_alloc(area_size, sizeof(uint32_t));
+    if (!mem_bitmap || !mem_map || !free_area_bits)
+        return 0;
+
+    printf("mm metadata at 0x%#x: bitmap %u bytes, mem_map %u bytes, free area map %u bytes\n",
+           mem_bitmap, bitmap_size, map_size, area_size);
+    return bitmap_size + map_size + area_size;
+}
+
 int page_bitmap_init(unsigned long addr)
 {
     multiboot_info_t *mbi = (multiboot_info_t*)addr;
     uint32_t nr_pages = 0;
-    uint32_t nr_slots = 0;
-    uint32_t i = 0, j = 0;
+    uint32_t meta_size = 0;
+    int i;
+
+    nr_mem_regions = 0;
+    memset(&memblock, 0, sizeof(memblock));
+    memblock.cursor = (unsigned long)&__kernel_end;
+    max_pfn = 0;
     if (CHECK_FLAG(mbi->flags, 6)) {
         memory_map_t *mmap;
-        printf("phy memory:\n");
         for (mmap = (memory_map_t *)mbi->mmap_addr;
                 (unsigned long)mmap < mbi->mmap_addr + mbi->mmap_length;
                 mmap = (memory_map_t *)((unsigned long)mmap + mmap->size + sizeof (mmap->size))) {
             if (mmap->type != 1)
                 continue;
-            if (!mmap->base_addr_high && !mmap->base_addr_low)
-                continue;
-            printf("    base_addr = 0x%#x%#x, length = 0x%#x%#x\n",
-                    (unsigned)mmap->base_addr_high,
-                    (unsigned)mmap->base_addr_low,
-                    (unsigned)mmap->length_high,
-                    (unsigned)mmap->length_low);
-            phy_mem_base = (((unsigned long long)mmap->base_addr_high) << 32) | (unsigned)mmap->base_addr_low;
-            phy_mem_len = (((unsigned long long)mmap->length_high) << 32) | (unsigned)mmap->length_low;
-            phy_mem_end = phy_mem_base + phy_mem_len;
+            add_mem_region((((uint64_t)mmap->base_addr_high) << 32) | (unsigned)mmap->base_addr_low,
+                           (((uint64_t)mmap->length_high) << 32) | (unsigned)mmap->length_low);
         }
     }
 
-    if (!phy_mem_len) {
+    if (!nr_mem_regions) {
         KERN_INFO("ERROR: no usable memory\n");
         return -ENOMEM;
     }
-    /* make memory size aligned to page_size*/
-    phy_mem_len &= ~PAGE_MASK;
-    /* mark all memory as used */
-    memset(mem_bitmap, 0xffffffff, sizeof(mem_bitmap));
 
-    nr_pages = phy_mem_len / PAGE_SIZE;
-    nr_slots = (nr_pages+BITS_IN_SLOT)/BITS_IN_SLOT;
-    printf("Memory base is %llx, size is %llx, there are %u pages, used %u slots\n",
-           phy_mem_base, phy_mem_len, nr_pages, nr_slots);
-    printf("bss start is %lx, bss end is %lx\n", (unsigned long)&__bss_start, (unsigned long)&__bss_end);
-    printf("kernel start is %lx, kernel end is %lx\n", (unsigned long)&__kernel_start, (unsigned long)&__kernel_end);
+    /* page 0 is never handed out, so that NULL always means allocation failure */
+    memblock_reserve(0, PAGE_SIZE);
+    memblock_reserve((unsigned long)&__kernel_start, (unsigned long)&__kernel_end);
+    memblock_reserve(STACK_TOP, STACK_BOTTOM);
+    memblock_reserve(VIDEO_MEM, VIDEO_MEM + PAGE_SIZE);
+    reserve_multiboot_info(mbi);
 
-    if (nr_slots >= SLOTS) {
-        /*
-         * qemu -m $memory is too large, or SLOTS was defined too small
-         * Ajust one of them, otherwise will happen unexpected memory overwritten.
-         */
-        KERN_INFO("BUG: error memory. BITS_IN_SLOT is %d, nr_slots is %d, SLOTS is %d\n", BITS_IN_SLOT, nr_slots, SLOTS);
-        return -EINVAL;
+    meta_size = alloc_mm_metadata();
+    if (!meta_size) {
+        KERN_INFO("ERROR: no memory for mm metadata, max pfn is 0x%x\n", max_pfn);
+        return -ENOMEM;
     }
 
-    /* every uint8 in mem_bitmap array */
-    for (i = 0; i < nr_slots; ++i) {
-        /* every bit in uint8 */
-        for (j = 0; j < BITS_IN_SLOT; ++j) {
-            unsigned long cur_addr = PAGE_SIZE * (i*BITS_IN_SLOT + j) + phy_mem_base;
-            /* mark kernel memory as used */
-            if (cur_addr >= (unsigned long)&__kernel_start && cur_addr < (unsigned long)&__kernel_end) {
-                // printf("cur addr %x is in kernel region, continue\n", cur_addr);
-                continue;
-            }
-            /* mark kernel stack as used */
-            if (cur_addr >= STACK_TOP && cur_addr < STACK_BOTTOM) {
-                // printf("cur addr %x is in stack region, continue\n", cur_addr);
-                continue;
-            }
-
-            /* Actually it's not necessary, because VIDEM_MEM is lower than phy_mem_base */
-            if (cur_addr >= VIDEO_MEM && cur_addr < VIDEO_MEM+PAGE_SIZE) {
-                continue;
-            }
-            mem_bitmap[i] &= ~(1 << j);
-            /* We set content of all free pages to 0. Here will waste lots time. */
-            memset((void*)cur_addr, 0, PAGE_SIZE);
-        }
+    for (i = 0; i < nr_mem_regions; ++i)
+        nr_pages += mem_regions[i].nr_pages;
+    printf("phy memory: %d regions, %u pages, max pfn is 0x%x\n", nr_mem_regions, nr_pages, max_pfn);
+    for (i = 0; i < nr_mem_regions; ++i) {
+        printf("    region%d: 0x%#x - 0x%#x, %u pages\n",
+               i, mem_regions[i].base, mem_regions[i].end, mem_regions[i].nr_pages);
     }
-    ITERATE_PAGES({}, {
-        unsigned long cur_addr = PAGE_SIZE * (__cur_slot*BITS_IN_SLOT + __cur_bit) + phy_mem_base;
-        printf("address %x is used, slot is %d, bit is %d\n", cur_addr, __cur_slot, __cur_bit);
-    });
+    /* in 1/10000 of managed pages, meta_size is rounded up to pages */
+    meta_size = (meta_size + PAGE_MASK) / PAGE_SIZE * 10000 / nr_pages;
+    printf("mm metadata overhead: %u.%u%u%% of memory\n", meta_size / 100, meta_size / 10 % 10, meta_size % 10);
+    printf("bss start is %lx, bss end is %lx\n", (unsigned long)&__bss_start, (unsigned long)&__bss_end);
+    printf("kernel start is %lx, kernel end is %lx\n", (unsigned long)&__kernel_start, (unsigned long)&__kernel_end);
 
     return 0;
 }
 
 extern char init_finish;
 /* @NOTE: caller must hold mm lock */
-int add_page_mapping(uint32_t linear_addr, uint32_t phy_addr)
+int add_page_mapping(pgd_t *pgd, uint32_t linear_addr, uint32_t phy_addr, uint32_t flags)
 {
     uint32_t pgd_offset = 0;
     uint32_t pde_offset = 0;
     pde_t pde;  // pde represents 4M size memory
     pte_t pte;  // pte represents 4K size memory
-    pgd_t *pgd = current()->mm->pgdir;
 
     panic_on(linear_addr % PAGE_SIZE, "linear address should be page aligned 0x%x", linear_addr);
 
@@ -228,10 +518,14 @@ int add_page_mapping(uint32_t linear_addr, uint32_t phy_addr)
     pde_offset = get_bits(linear_addr, 12, 21);
 
     pde = (uint32_t)pgd[pgd_offset];
+    panic_on(CHECK_FLAG(pde, PS_BIT), "0x%x is already mapped by a 4M page\n", linear_addr);
     if (!pde) {
         pde = (uint32_t)alloc_pgdir();
+        panic_on(!pde, "no memory for page table\n");
         pde |= (1 << PRESENT_BIT);
         pde |= (1 << RW_BIT);
+        /* access rights of pte decide, pde must allow user access for user pages */
+        pde |= (flags & (1 << US_BIT));
         pgd[pgd_offset] = (uint32_t)pde;
     }
 
@@ -239,198 +533,550 @@ int add_page_mapping(uint32_t linear_addr, uint32_t phy_addr)
     pte = ((uint32_t*)pde)[pde_offset];
     if (!pte) {
         pte = (uint32_t)(phy_addr & ~(PAGE_MASK));
-        pte |= (1 << PRESENT_BIT);
-        pte |= (1 << RW_BIT);
+        pte |= flags;
         ((uint32_t*)pde)[pde_offset] = pte;
     }
     return 0;
 }
 
+/*
+ * Map 4M linear address to 4M physical memory with one pde, e.g. an order-10 block from buddy system,
+ * both addresses must be 4M aligned. Needs CR4.PSE, see enable_paging().
+ * @NOTE: caller must hold mm lock
+ */
+int add_large_page_mapping(pgd_t *pgd, uint32_t linear_addr, uint32_t phy_addr, uint32_t flags)
+{
+    uint32_t pgd_offset = get_bits(linear_addr, 22, 31);
+
+    panic_on(linear_addr % LARGE_PAGE_SIZE || phy_addr % LARGE_PAGE_SIZE,
+             "4M page mapping 0x%x -> 0x%x is not aligned\n", linear_addr, phy_addr);
+    if (pgd[pgd_offset])
+        return -EEXIST;
+
+    pgd[pgd_offset] = (phy_addr & ~LARGE_PAGE_MASK) | (1 << PS_BIT) | flags;
+    return 0;
+}
+
+/* Map a page of memory mapped io at fix_to_virt(idx), it's not cached */
+void set_fixmap(int idx, uint32_t phy_addr)
+{
+    pte_t *fixmap = (pte_t*)(init_pgtbl_dir[FIXADDR_START >> 22] & ~PAGE_MASK);
+    uint32_t addr = fix_to_virt(idx);
+
+    panic_on(idx < 0 || idx >= NR_FIXMAPS, "invalid fixmap %d\n", idx);
+    fixmap[get_bits(addr, 12, 21)] = (phy_addr & ~PAGE_MASK) | PAGE_KERNEL | (1 << PWT_BIT) | (1 << PCD_BIT);
+    invlpg(addr);
+}
+
+static bool pse_supported()
+{
+    uint32_t regs[4] = {0};
+
+    cpuid(1, regs);
+    return CHECK_FLAG(regs[3], 3);
+}
+
+bool pge_supported()
+{
+    uint32_t regs[4] = {0};
+
+    cpuid(1, regs);
+    return CHECK_FLAG(regs[3], 13);
+}
+
+/*
+ * Identity map [start, end) of physical memory. The first 4M is always mapped by 4K pages so that page 0 can be
+ * left unmapped, others are mapped by 4M pages when cpu supports PSE.
+ * Kernel mappings are the same in every page directory, so they are global and survive CR3 reloading.
+ */
+static void identity_map_range(pgd_t *pgd, unsigned long start, unsigned long end, bool pse)
+{
+    unsigned long addr = start & ~PAGE_MASK;
+
+    while (addr < end) {
+        if (pse && addr >= LARGE_PAGE_SIZE) {
+            addr &= ~LARGE_PAGE_MASK;
+            add_large_page_mapping(pgd, addr, addr, PAGE_KERNEL);
+            addr += LARGE_PAGE_SIZE;
+        } else {
+            if (addr)
+                add_page_mapping(pgd, addr, addr, PAGE_KERNEL);
+            addr += PAGE_SIZE;
+        }
+        /* end of the last 4M page of 4G memory wraps to 0 */
+        if (!addr)
+            break;
+    }
+}
+
 int page_table_init()
 {
+    bool pse = pse_supported();
+    pte_t *fixmap;
+    int i;
+
     /* A pgd_t pointer points to a page, which contains 1024 pde_t */
     init_pgtbl_dir = alloc_pgdir();
-    memset(init_pgtbl_dir, 0, PAGE_SIZE);
+    if (!init_pgtbl_dir)
+        return -ENOMEM;
+    init_mm.pgdir = init_pgtbl_dir;
+    INIT_LIST(&init_mm.mmap);
     /*
-     * We must ensure that
-     * linear address 0x&__kenel_start map to phy addr 0x&_kernel_start
-     *                0x(&__kernel_start + 4k) map to phy addr 0x(&__kernel_start + 4k)
-     *                ...
-     *                0x(&__kernel_end) map to phy addr 0x(&__kernel_end)
+     * Kernel accesses all physical memory through identity mapping, including the kernel itself, its stack and
+     * every page from buddy system. Memory above 4M is mapped by 4M pages, so it takes no page table and one TLB
+     * entry covers a whole order-10 block. Page 0 is left unmapped to catch NULL pointer dereference.
      */
+    for (i = 0; i < nr_mem_regions; ++i)
+        identity_map_range(init_pgtbl_dir, mem_regions[i].base, mem_regions[i].end, pse);
+    identity_map_range(init_pgtbl_dir, (unsigned long)&__kernel_start, (unsigned long)&__kernel_end, pse);
+    identity_map_range(init_pgtbl_dir, STACK_TOP, STACK_BOTTOM, pse);
+    identity_map_range(init_pgtbl_dir, VIDEO_MEM, VIDEO_MEM + PAGE_SIZE, pse);
+    fixmap = alloc_pgdir();
+    if (!fixmap)
+        return -ENOMEM;
+    init_pgtbl_dir[FIXADDR_START >> 22] = (uint32_t)fixmap | (1 << PRESENT_BIT) | (1 << RW_BIT);
 
-    ITERATE_PAGES({}, {
-       unsigned long cur_addr = PAGE_SIZE * (__cur_slot*BITS_IN_SLOT + __cur_bit) + phy_mem_base;
-       if (cur_addr >= (unsigned long)&__kernel_start)
-           add_page_mapping(cur_addr, cur_addr);
-    });
-    add_page_mapping(VIDEO_MEM , VIDEO_MEM);
-
+    printf("kernel identity map uses %s pages\n", pse ? "4M" : "4K");
     return 0;
 }
 
+static pfn_t find_buddy_pfn(pfn_t pfn, char order)
+{
+    return pfn ^ (1 << order);
+}
+
+static inline unsigned long pfn_to_page(pfn_t pfn)
+{
+    return pfn * PAGE_SIZE;
+}
+
+static inline pfn_t page_to_pfn(unsigned long addr)
+{
+    return addr / PAGE_SIZE;
+}
+
 /*
- * Check if the contious (1 << order) pages begining at addr is freed.
- * For example: order == 4, check if all contious 16 bit are 0
- *              There are 3 bytes: 001000[00 00000000 000000]10
- *              Check the bits in [...]
+ * Put the free block into the free list of its order and mark its head page in mem_map.
+ * Blocks whose content is not known to be zero are put at the head of the list, zeroed blocks at the tail,
+ * so that normal allocations consume dirty blocks first, and zero_free_pages() finds work by looking at the head.
  */
-static bool pages_is_free(unsigned long addr, uint8_t order)
+static void add_to_free_list(pfn_t pfn, char order, bool zeroed)
+{
+    struct page *page = pfn_to_struct_page(pfn);
+    struct list *block = (struct list*)pfn_to_page(pfn);
+    struct zone *zone = pfn_to_zone(pfn);
+    struct free_mem_stcutre *area = &zone->free_area;
+
+    page_set_flag(page, PG_BUDDY);
+    page->order = order;
+    INIT_LIST(block);
+    if (zeroed) {
+        page_set_flag(page, PG_ZEROED);
+        list_add_tail(get_free_pages_head(zone, order), block);
+        area->zeroed_free_pages += (1 << order);
+    } else {
+        list_add_head(get_free_pages_head(zone, order), block);
+    }
+    area->nr_free_pages[order]++;
+    area->all_free_pages += (1 << order);
+    mem_regions[page->region].nr_free += (1 << order);
+    set_bit(pfn >> order, free_area_map[order]);
+    area->free_area_summary |= (1 << order);
+}
+
+/* @return: whether the content of the block was zeroed */
+static bool del_from_free_list(pfn_t pfn, char order)
 {
-    int cur_slot = 0;
-    int cur_bit = 0;
-    int nr_bits = 1 << order;
+    struct page *page = pfn_to_struct_page(pfn);
+    bool zeroed = page_test_flag(page, PG_ZEROED);
+
+    struct free_mem_stcutre *area = &pfn_to_zone(pfn)->free_area;
+
+    page_clear_flag(page, PG_BUDDY);
+    page_clear_flag(page, PG_ZEROED);
+    page->order = 0;
+    list_del((struct list*)pfn_to_page(pfn));
+    if (zeroed)
+        area->zeroed_free_pages -= (1 << order);
+    area->nr_free_pages[order]--;
+    area->all_free_pages -= (1 << order);
+    mem_regions[page->region].nr_free -= (1 << order);
+    clear_bit(pfn >> order, free_area_map[order]);
+    if (!area->nr_free_pages[order])
+        area->free_area_summary &= ~(1 << order);
+
+    return zeroed;
+}
 
-    page_bitmap_get_location(addr, &cur_slot, &cur_bit);
-    if (cur_slot >= SLOTS) {
-        panic("invalid slot %d\n", cur_slot);
+/* Check if pfn is the head of a free block whose size is exactly (1 << order) pages */
+static inline bool page_is_buddy(pfn_t pfn, char order)
+{
+    if (pfn >= max_pfn)
         return false;
-    }
+    return test_bit(pfn >> order, free_area_map[order]);
+}
 
-    if (cur_bit != 0 && nr_bits > 0) {
-        // 先处理那些非byte对齐的bit
-        int remain_bits = 8 - cur_bit;
-        int bits = remain_bits;
+/*
+ * Merge the free block with its buddy as long as the buddy is a free block of the same order,
+ * then put the merged block into the free list. Every level costs O(1).
+ */
+static void try_to_merge(pfn_t pfn, char order, bool zeroed)
+{
+    pfn_t buddy_pfn;
 
-        if (nr_bits < remain_bits)
-            bits = nr_bits;
-        if (get_bits(mem_bitmap[cur_slot], cur_bit, cur_bit+bits-1) != 0) {
-            goto out_used;
-        }
-        nr_bits -= bits;
-        cur_slot++;
+    while (order < _MAX_ORDER) {
+        buddy_pfn = find_buddy_pfn(pfn, order);
+        if (!page_is_buddy(buddy_pfn, order))
+            break;
+        /* merged block is zeroed only if both halves are zeroed */
+        zeroed = del_from_free_list(buddy_pfn, order) && zeroed;
+        buddy_stats.merge[order]++;
+        pfn = pfn < buddy_pfn ? pfn : buddy_pfn;
+        order++;
     }
+    add_to_free_list(pfn, order, zeroed);
+}
 
-    panic_on(nr_bits < 0, "invalid bits %d\n", nr_bits);
-    // 再处理那些byte对齐的bits，直接作为uint8判断是否为0
-    if (nr_bits >= (sizeof(uint8_t) * 8)) {
-        int nr_slots = nr_bits/8;
+/*
+ * Cut free pages [start, end) into the largest blocks that are aligned to their size, from low to high.
+ * Such blocks never have a free buddy of the same order, so they go into free lists without merging.
+ */
+static void free_pages_range(pfn_t start, pfn_t end)
+{
+    char order;
+
+    while (start < end) {
+        order = start ? __ffs(start) : _MAX_ORDER;
+        if (order > _MAX_ORDER)
+            order = _MAX_ORDER;
+        if ((1 << order) > end - start)
+            order = __fls(end - start);
+        add_to_free_list(start, order, false);
+        start += (1 << order);
+    }
+}
 
-        while (nr_slots--) {
-            if (mem_bitmap[cur_slot] != 0)
-                goto out_used;
-            cur_slot++;
+/* Give every run of free pages in region to buddy system, it's linear in number of pages */
+static void __init_free_pages_list(int region)
+{
+    pfn_t pfn = mem_regions[region].base / PAGE_SIZE;
+    pfn_t end = mem_regions[region].end / PAGE_SIZE;
+    pfn_t run = pfn;    // first page of current free run
+
+    for (; pfn < end; ++pfn) {
+        pfn_to_struct_page(pfn)->region = region;
+        if (page_bitmap_is_busy(pfn_to_page(pfn))) {
+            mem_regions[region].nr_reserved++;
+            free_pages_range(run, pfn);
+            run = pfn + 1;
         }
+    }
+    free_pages_range(run, end);
+}
 
-        nr_bits %= 8;
+/* Stop memblock, mark reserved pages and the holes between regions as used in mem_bitmap */
+static void memblock_close()
+{
+    int i;
+
+    memblock.closed = true;
+    page_bitmap_set_range(0, max_pfn, true);
+    for (i = 0; i < nr_mem_regions; ++i)
+        page_bitmap_set_range(mem_regions[i].base / PAGE_SIZE, mem_regions[i].end / PAGE_SIZE, false);
+    /* a page is used if any byte of it is reserved */
+    for (i = 0; i < memblock.nr_reserved; ++i) {
+        page_bitmap_set_range(memblock.reserved[i].start / PAGE_SIZE,
+                              (memblock.reserved[i].end + PAGE_MASK) / PAGE_SIZE, true);
     }
+    printf("memblock: %u bytes allocated, %d reserved ranges\n", memblock.allocated, memblock.nr_reserved);
+}
 
-    // 最后处理那些在尾部byte不对齐的bits
-    if (nr_bits > 0) {
-        if (get_bits(mem_bitmap[cur_slot], 0, nr_bits-1) != 0) {
-            goto out_used;
-        }
+static void pcp_drain(struct per_cpu_pages *pcp, uint32_t nr);
+
+static void init_zones()
+{
+    uint32_t min, reserve = 0;
+    struct zone *zone;
+    int i;
+
+    for (i = NR_ZONES - 1; i >= 0; --i) {
+        zone = &zones[i];
+        zone->managed_pages = zone->free_area.all_free_pages;
+        min = zone->managed_pages / 256;
+        if (min < MIN_WMARK_PAGES)
+            min = MIN_WMARK_PAGES;
+        if (min > MAX_WMARK_PAGES)
+            min = MAX_WMARK_PAGES;
+        if (min > zone->managed_pages / 4)
+            min = zone->managed_pages / 4;
+        zone->watermark[WMARK_MIN] = min;
+        zone->watermark[WMARK_LOW] = min + min / 4;
+        zone->watermark[WMARK_HIGH] = min + min / 2;
+
+        zone->lowmem_reserve = reserve / LOWMEM_RESERVE_RATIO;
+        if (zone->lowmem_reserve > zone->managed_pages / 2)
+            zone->lowmem_reserve = zone->managed_pages / 2;
+        reserve += zone->managed_pages;
     }
+}
 
-    return true;
-out_used:
-    if (order == 0)
-        printf("addr %x is used, slot is %d, bit is %d\n", addr, cur_slot, cur_bit);
-    return false;
+/*
+ * Raise all watermarks of a zone by pages, so that it comes under memory pressure while more memory is free.
+ * 0 takes the boost back.
+ */
+void set_watermark_boost(int zone, uint32_t pages)
+{
+    unsigned long flags;
+
+    cli_and_save(flags);
+    zones[zone].watermark_boost = pages;
+    restore_flags(flags);
 }
 
-static pfn_t find_buddy_pfn(pfn_t pfn, char order)
+/*
+ * Whether (1 << order) pages can be allocated with more than mark free pages left. Pages in blocks smaller than
+ * order can't serve the request, so they are not counted, and the mark is halved for each order above 0 as
+ * high order blocks are not expected to be plenty.
+ */
+static bool watermark_ok(struct zone *zone, char order, uint32_t mark)
 {
-    return pfn ^ (1 << order);
+    /* signed, free pages of lower orders may be more than what is left */
+    int32_t free = (int32_t)zone->free_area.all_free_pages - (1 << order);
+    char o;
+
+    if (free < (int32_t)mark)
+        return false;
+    for (o = 0; o < order; ++o) {
+        free -= (int32_t)(zone->free_area.nr_free_pages[o] << o);
+        mark >>= 1;
+        if (free <= (int32_t)mark)
+            return false;
+    }
+    return true;
 }
 
-static inline unsigned long pfn_to_page(pfn_t pfn)
+/* Whether every zone ordinary allocations may use is below low watermark, caches should keep less memory then */
+bool mm_under_pressure()
 {
-    return (pfn * PAGE_SIZE) + phy_mem_base;
+    struct zone *preferred = gfp_zone(GFP_KERNEL), *zone;
+    uint32_t mark;
+
+    for (zone = preferred; zone >= zones; --zone) {
+        mark = wmark_pages(zone, WMARK_LOW);
+        if (zone != preferred)
+            mark += zone->lowmem_reserve;
+        if (zone->free_area.all_free_pages > mark)
+            return false;
+    }
+    return true;
 }
 
-static inline pfn_t page_to_pfn(unsigned long addr)
+void register_shrinker(struct shrinker *shrinker)
 {
-    return (addr - phy_mem_base) / PAGE_SIZE;
+    unsigned long flags;
+
+    cli_and_save(flags);
+    list_add_tail(&shrinkers, &shrinker->list);
+    restore_flags(flags);
 }
 
-/* @return: return the next address to be inited */
-static unsigned long __init_free_pages_list(unsigned long addr)
+void unregister_shrinker(struct shrinker *shrinker)
 {
-    char order = 0;
-    struct list* head = NULL;
-    pfn_t pfn = page_to_pfn(addr);
-    pfn_t bd_pfn = find_buddy_pfn(pfn, order);
-    unsigned long bd_addr = pfn_to_page(bd_pfn);
-    unsigned adr = addr;
+    unsigned long flags;
 
-    if (!pages_is_free(addr, order)) {
-        return addr + PAGE_SIZE;
-    }
+    cli_and_save(flags);
+    list_del(&shrinker->list);
+    restore_flags(flags);
+}
 
-    while (order < MAX_ORDER) {
-        if (!pages_is_free(bd_addr , order) || order == _MAX_ORDER) {
+/*
+ * Slow path of allocation, ask shrinkers for enough pages to bring free pages of zone back to high watermark, or
+ * all they have if free pages are below min. Shrinkers don't choose which zone the pages come from.
+ * @return: number of pages given back
+ * @NOTE: caller must disable interrupts
+ */
+static uint32_t reclaim_pages(struct zone *zone, char order)
+{
+    uint32_t free = zone->free_area.all_free_pages;
+    uint32_t nr = 1 << order, freed = 0;
+    struct shrinker *shrinker;
+    struct list *cur;
+
+    if (free < wmark_pages(zone, WMARK_MIN))
+        nr = (uint32_t)-1;
+    else if (free < wmark_pages(zone, WMARK_HIGH))
+        nr += wmark_pages(zone, WMARK_HIGH) - free;
+
+    buddy_stats.pressure++;
+    list_for_each(cur, &shrinkers) {
+        shrinker = list_entry(cur, struct shrinker, list);
+        freed += shrinker->shrink(nr - freed);
+        if (freed >= nr)
             break;
-        }
-        if (addr != bd_addr && ((struct list*)bd_addr)->next) {
-            list_del((struct list*)bd_addr);
-            phy_mm_stcutre.nr_free_pages[order]--;
-        }
-        addr = addr < bd_addr ? addr : bd_addr;
-        order++;
-        pfn = page_to_pfn(addr);
-        bd_pfn = find_buddy_pfn(pfn, order);
-        bd_addr = pfn_to_page(bd_pfn);
     }
+    buddy_stats.reclaimed += freed;
+    return freed;
+}
 
-    phy_mm_stcutre.nr_free_pages[order]++;
-    phy_mm_stcutre.all_free_pages += (1 << order);
-    head = get_free_pages_head(order);
-    INIT_LIST((struct list*)addr);
-    list_add_tail(head , (struct list*)addr);
-    adr += (PAGE_SIZE * (1 << order));
+/* Give back pages cached by local cpu */
+static uint32_t pcp_shrink(uint32_t nr_pages)
+{
+    struct per_cpu_pages *pcp = this_cpu_pcp();
+    uint32_t nr = pcp->count;
 
-    return adr;
+    pcp_drain(pcp, nr);
+    return nr;
 }
 
+static struct shrinker pcp_shrinker = { "pcp", pcp_shrink };
+
+/* Hand all memory that memblock doesn't reserve to buddy system */
 int init_free_pages_list()
 {
-    int i = 0;
-    unsigned long cur_addr = phy_mem_base;
+    int i = 0, j;
+    uint32_t *map = free_area_bits;
 
-    memset(&phy_mm_stcutre, 0, sizeof(phy_mm_stcutre));
+    memblock_close();
+    /* Free pages are not zeroed here, see alloc_pages_zeroed() and zero_free_pages() */
+
+    memset(mem_map, 0, max_pfn * sizeof(struct page));
+    memset(free_area_bits, 0, free_area_longs * sizeof(uint32_t));
     for (i = 0; i < MAX_ORDER; ++i) {
-        INIT_LIST(get_free_pages_head(i));
+        free_area_map[i] = map;
+        map += BITS_TO_LONGS((max_pfn >> i) + 1);
     }
-
-    while (cur_addr < phy_mem_end) {
-        cur_addr = __init_free_pages_list(cur_addr);
+    for (i = 0; i < NR_ZONES; ++i) {
+        memset(&zones[i].free_area, 0, sizeof(zones[i].free_area));
+        for (j = 0; j < MAX_ORDER; ++j)
+            INIT_LIST(get_free_pages_head(&zones[i], j));
     }
+    if (zones[ZONE_DMA].end_pfn > max_pfn)
+        zones[ZONE_DMA].end_pfn = max_pfn;
+    zones[ZONE_NORMAL].start_pfn = zones[ZONE_DMA].end_pfn;
+    zones[ZONE_NORMAL].end_pfn = max_pfn;
+
+    for (i = 0; i < nr_mem_regions; ++i)
+        __init_free_pages_list(i);
+
+    for (i = 0; i < NR_CPUS; ++i) {
+        memset(&pcp_pages[i], 0, sizeof(pcp_pages[i]));
+        INIT_LIST(&pcp_pages[i].list);
+        pcp_pages[i].high = PCP_HIGH;
+        pcp_pages[i].batch = PCP_BATCH;
+    }
+    init_zones();
+    register_shrinker(&pcp_shrinker);
+    /* merging free pages into blocks above is not what we want to count */
+    memset(&buddy_stats, 0, sizeof(buddy_stats));
 
     return 0;
 }
 
+/* Fill stats with the counters and a snapshot of free areas */
+void mm_get_stats(struct buddy_stats *stats)
+{
+    struct free_mem_stcutre *area;
+    unsigned long flags;
+    uint32_t suitable = 0;
+    int i, z;
+
+    cli_and_save(flags);
+    memcpy(stats, &buddy_stats, sizeof(*stats));
+    for (z = 0; z < NR_ZONES; ++z) {
+        area = &zones[z].free_area;
+        for (i = 0; i < MAX_ORDER; ++i)
+            stats->nr_free[i] += area->nr_free_pages[i];
+        stats->free_pages += area->all_free_pages;
+        stats->zeroed_pages += area->zeroed_free_pages;
+        stats->zone_free[z] = area->all_free_pages;
+        for (i = 0; i < NR_WMARK; ++i)
+            stats->watermark[z][i] = wmark_pages(&zones[z], i);
+    }
+    for (i = 0; i < nr_mem_regions; ++i)
+        stats->total_pages += mem_regions[i].nr_pages - mem_regions[i].nr_reserved;
+    for (i = 0; i < NR_CPUS; ++i) {
+        stats->pcp_pages += pcp_pages[i].count;
+        stats->pcp_hit += pcp_pages[i].hit;
+        stats->pcp_miss += pcp_pages[i].miss;
+    }
+    restore_flags(flags);
+
+    for (i = _MAX_ORDER; i >= 0; --i) {
+        suitable += stats->nr_free[i] << i;
+        stats->frag_index[i] = stats->free_pages ?
+                               (stats->free_pages - suitable) * 1000 / stats->free_pages : 1000;
+    }
+}
+
 void mm_show_statistics(uint32_t ret[MAX_ORDER])
 {
-    int i = 0;
+    uint32_t nr_free, all_free = 0, zeroed = 0;
+    struct zone *zone;
+    int i = 0, z;
     while (i < MAX_ORDER) {
+        for (z = 0, nr_free = 0; z < NR_ZONES; ++z)
+            nr_free += zones[z].free_area.nr_free_pages[i];
         if (ret) {
-            ret[i] = phy_mm_stcutre.nr_free_pages[i];
+            ret[i] = nr_free;
         }
-        printf("order%d: %u\n", i, phy_mm_stcutre.nr_free_pages[i]);
+        printf("order%d: %u\n", i, nr_free);
         ++i;
     }
 
-    printf("There are %u free pages\n", phy_mm_stcutre.all_free_pages);
+    for (z = 0; z < NR_ZONES; ++z) {
+        all_free += zones[z].free_area.all_free_pages;
+        zeroed += zones[z].free_area.zeroed_free_pages;
+    }
+    printf("There are %u free pages, %u of them are zeroed\n", all_free, zeroed);
+    printf("%u pages in use, peak %u, %u pages reclaimed\n",
+           buddy_stats.used_pages, buddy_stats.peak_used_pages, buddy_stats.reclaimed);
+    for (z = 0; z < NR_ZONES; ++z) {
+        zone = &zones[z];
+        printf("zone %s: %u free of %u pages, watermarks %u %u %u, reserve %u\n", zone->name,
+               zone->free_area.all_free_pages, zone->managed_pages, wmark_pages(zone, WMARK_MIN),
+               wmark_pages(zone, WMARK_LOW), wmark_pages(zone, WMARK_HIGH), zone->lowmem_reserve);
+    }
+    for (i = 0; i < nr_mem_regions; ++i) {
+        printf("region%d: %u pages, %u reserved, %u free\n",
+               i, mem_regions[i].nr_pages, mem_regions[i].nr_reserved, mem_regions[i].nr_free);
+    }
+    for (i = 0; i < NR_CPUS; ++i) {
+        printf("cpu%d pcp: %u pages, hit %u, miss %u\n",
+               i, pcp_pages[i].count, pcp_pages[i].hit, pcp_pages[i].miss);
+    }
 }
 
 int init_paging(unsigned long addr)
 {
     int ret = 0;
+    uint32_t start = (uint32_t)rdtsc(), us;
 
     if ((ret = page_bitmap_init(addr))) {
         return ret;
     }
     clear();
 
+    /* page tables come from memblock, so identity mapping is built before buddy system takes the rest */
+    if ((ret = page_table_init()))
+        return ret;
+
     if ((ret = init_free_pages_list())) {
         return ret;
     }
+    us = cycles_to_us((uint32_t)rdtsc() - start);
     clear();
     mm_show_statistics(NULL);
+    printf("memory init took %u.%u%u%u ms\n", us / 1000, us / 100 % 10, us / 10 % 10, us % 10);
 
-    if ((ret = page_table_init()))
-        return ret;
+    /* shrinkers run in the order they are registered, blocks leaving quarantine may empty slabs */
+    mm_debug_init();
+    kmem_cache_init();
+    if (kmalloc_init())
+        return -ENOMEM;
+    mm_cachep = kmem_cache_create("mm", sizeof(struct mm), 0, NULL);
+    vma_cachep = kmem_cache_create("vm_area", sizeof(struct vm_area), 0, NULL);
+    if (!mm_cachep || !vma_cachep)
+        return -ENOMEM;
     clear();
     mm_show_statistics(NULL);
 
@@ -440,21 +1086,36 @@ int init_paging(unsigned long addr)
 void enable_paging()
 {
     uint32_t regs[4] = {0};// rax rbx rcx rdx
+    uint32_t cr4;
 
     /*
     * As we said in the comments(NOTE2) at the beginning of this file, we use 32-bit paging mode
     * About the details of how to enable paging, see chapter 4.1.2(Paging-mode Enabling) intel manual volume 3.
     */
-    /* load init_pgtbl_dir to CR3 register */
+    /*
+     * set CR4.PSE = 1 so that pde with PS_BIT maps 4M page, CR4.PAE(disable PAE) = 0
+     * set CR4.PGE = 1 so that kernel mappings(GLOBAL_BIT set) are not flushed when CR3 is reloaded
+     */
+    cr4 = read_cr4() & ~X86_CR4_PAE;
+    if (pse_supported())
+        cr4 |= X86_CR4_PSE;
+    if (pge_supported())
+        cr4 |= X86_CR4_PGE;
+    write_cr4(cr4);
+
+    /*
+     * load init_pgtbl_dir to CR3 register, then set CR0.PG = 1
+     * CR0.WP = 1 makes kernel writes to read only pages fault too, so that user pages shared by fork are copied
+     * when kernel writes them on behalf of user, see copy_to_user()
+     */
     asm volatile (  "movl %0, %%cr3;"
                     "movl %%cr0, %%eax;"
-                    "orl $0x80000000, %%eax;"
+                    "orl $0x80010000, %%eax;"
                     "movl %%eax, %%cr0;"
                     :  /* no output */
                     :"r"(init_pgtbl_dir)  /* input pgtable dir */
                     : "eax");
 
-    /* set CR0.PG = 1 and CR4.PAE(disable PAE) = 0, CR4.PSE = 0(disable reserved bits) */
 
     /* After enable paging, do some sanity check. Chapter 4.1.4 */
     cpuid(1, regs);
@@ -466,6 +1127,26 @@ void enable_paging()
     printf("a is %d\n", a);
 }
 
+/* Count an allocation of (1 << order) pages, page is NULL if it failed. @NOTE: caller must disable interrupts */
+static inline void count_alloc(char order, void *page)
+{
+    if (unlikely(!page)) {
+        buddy_stats.fail[order]++;
+        return;
+    }
+    buddy_stats.alloc[order]++;
+    buddy_stats.used_pages += (1 << order);
+    if (buddy_stats.used_pages > buddy_stats.peak_used_pages)
+        buddy_stats.peak_used_pages = buddy_stats.used_pages;
+}
+
+/* @NOTE: caller must disable interrupts */
+static inline void count_free(char order)
+{
+    buddy_stats.free[order]++;
+    buddy_stats.used_pages -= (1 << order);
+}
+
 /*
  * For example: split 2 pages from list3 which contains 8 pages
  * Original state
@@ -482,123 +1163,847 @@ void enable_paging()
  *          list3:**
  *
  */
-static void split_free_pages_list(char cur_order, char ori_order)
+static void split_free_pages_list(pfn_t pfn, char cur_order, char ori_order, bool zeroed)
 {
-    unsigned long addr = 0;
-    unsigned long cur_addr = 0;
+    while (cur_order-- > ori_order) {
+        buddy_stats.split[cur_order + 1]++;
+        add_to_free_list(pfn + (1 << cur_order), cur_order, zeroed);
+    }
+}
 
-    addr = (unsigned long)(get_free_pages_head(cur_order)->next);
+/*
+ * A zeroed block is preferred only if gfp has __GFP_ZERO, others use up dirty blocks first
+ * @zeroed: if not NULL, return whether the allocated block is zeroed
+ * @NOTE: caller must disable interrupts
+ */
+static void* __rmqueue(struct zone *zone, gfp_t gfp, char order, bool *zeroed)
+{
+    struct list *head = NULL;
+    uint32_t avail = 0;
+    char cur_order;
+    bool is_zeroed;
+    pfn_t pfn;
+
+    /* all orders that are not smaller than the request order and have free blocks */
+    avail = zone->free_area.free_area_summary & ~((1 << order) - 1);
+    if (unlikely(!avail))
+        return NULL;
+    cur_order = __ffs(avail);
+
+    /* dirty blocks are at the head, zeroed blocks are at the tail */
+    head = get_free_pages_head(zone, cur_order);
+    head = (gfp & __GFP_ZERO) ? head->prev : head->next;
+    pfn = page_to_pfn((unsigned long)head);
+    is_zeroed = del_from_free_list(pfn, cur_order);
+    if (cur_order != order)
+        split_free_pages_list(pfn, cur_order, order, is_zeroed);
+    page_bitmap_set_busy(head, order);
+    if (zeroed)
+        *zeroed = is_zeroed;
+
+    panic_on(((unsigned long)head & PAGE_MASK), "invalid page address 0x%x\n", head);
+    return head;
+}
 
-    while (cur_order-- > ori_order) {
-        cur_addr = addr + ((1 << cur_order) * PAGE_SIZE);
-        list_add_tail(get_free_pages_head(cur_order), (struct list*)cur_addr);
-        phy_mm_stcutre.nr_free_pages[cur_order]++;
+/*
+ * Take a block from the zone picked by gfp, or from a lower zone when it is short of memory.
+ * @check_low: use a zone only if it stays above low watermark, otherwise only lowmem_reserve of lower zones is kept
+ * @NOTE: caller must disable interrupts
+ */
+static void* get_page_from_zones(gfp_t gfp, char order, bool check_low, bool *zeroed)
+{
+    struct zone *preferred = gfp_zone(gfp), *zone;
+    uint32_t mark;
+    void *page;
+
+    for (zone = preferred; zone >= zones; --zone) {
+        mark = check_low ? wmark_pages(zone, WMARK_LOW) : 0;
+        if (zone != preferred)
+            mark += zone->lowmem_reserve;
+        if (mark && !watermark_ok(zone, order, mark))
+            continue;
+        if ((page = __rmqueue(zone, gfp, order, zeroed)))
+            return page;
     }
+    return NULL;
+}
+
+/*
+ * Allocate a block of gfp, when all zones it may use are below low watermark, reclaim memory first, and try
+ * again after reclaiming as long as there is no block large enough, see @NOTE about memory pressure.
+ * @NOTE: caller must disable interrupts
+ */
+static void* __rmqueue_reclaim(gfp_t gfp, char order, bool *zeroed)
+{
+    struct zone *zone = gfp_zone(gfp);
+    void *page;
+    int retries = 0;
+
+    page = get_page_from_zones(gfp, order, true, zeroed);
+    if (likely(page))
+        return page;
+    reclaim_pages(zone, order);
+    while (!(page = get_page_from_zones(gfp, order, false, zeroed)) && retries++ < MAX_RECLAIM_RETRIES) {
+        if (!reclaim_pages(zone, order))
+            break;
+    }
+    return page;
+}
+
+/* @NOTE: caller must disable interrupts */
+static void __free_pages(void *addr, char order, bool zeroed)
+{
+    pfn_t pfn = page_to_pfn((unsigned long)addr);
+
+    panic_on(pfn_to_struct_page(pfn)->flags & ((1 << PG_BUDDY) | (1 << PG_PCP)), "double free page 0x%x\n", addr);
+    page_bitmap_set_free(addr, order);
+    try_to_merge(pfn, order, zeroed);
+}
+
+/*
+ * Get (1 << order) pages of gfp from buddy system
+ * @caller: who asked for the pages, recorded by MM_DEBUG
+ */
+static void* buddy_alloc(gfp_t gfp, char order, void *caller)
+{
+    void *page = NULL;
+    unsigned long flags;
+    bool zeroed = false;
+    panic_on(order < 0 || order >= MAX_ORDER, "invalid request order %d\n", order);
+
+    cli_and_save(flags);
+    page = __rmqueue_reclaim(gfp, order, &zeroed);
+    count_alloc(order, page);
+    restore_flags(flags);
+    if (!page)
+        return NULL;
+
+    if ((gfp & __GFP_ZERO) && !zeroed)
+        memset(page, 0, PAGE_SIZE << order);
+    mm_debug_alloc(MM_DEBUG_PAGES, page, PAGE_SIZE << order, caller);
+    return page;
+}
+
+/* Get (1 << order) pages from the zone picked by gfp, or from a lower zone, see @NOTE about zones in mm.h */
+void* __alloc_pages(gfp_t gfp, char order)
+{
+    return buddy_alloc(gfp, order, __builtin_return_address(0));
 }
 
 /* Get (1 << order) pages from buddy system */
 void* alloc_pages(char order)
 {
+    return buddy_alloc(GFP_KERNEL, order, __builtin_return_address(0));
+}
+
+/* Give the block back to buddy system when it leaves quarantine of MM_DEBUG, see mm_debug.h */
+static void release_pages(void *addr, uint32_t size)
+{
+    unsigned long flags;
+    char order = __fls(size / PAGE_SIZE);
+
+    cli_and_save(flags);
+    __free_pages(addr, order, false);
+    count_free(order);
+    restore_flags(flags);
+}
+
+/* Return (1 << order) pages to buddy system */
+void free_pages(void *addr, char order)
+{
+    unsigned long flags;
+
+    panic_on(order < 0 || order >= MAX_ORDER, "invalid order %d\n", order);
+    if (mm_debug_free(MM_DEBUG_PAGES, addr, PAGE_SIZE << order, __builtin_return_address(0), release_pages))
+        return;
+    cli_and_save(flags);
+    __free_pages(addr, order, false);
+    count_free(order);
+    restore_flags(flags);
+}
+
+/*
+ * Move batch pages from buddy system to the tail of pcp list, only the first page may take the slow path, the
+ * others are taken as long as zones are above low watermark.
+ * @NOTE: caller must disable interrupts
+ */
+static void pcp_refill(struct per_cpu_pages *pcp)
+{
+    struct list *page;
+    struct page *desc;
+    bool zeroed;
+    int i = 0;
+
+    page = __rmqueue_reclaim(GFP_KERNEL, 0, &zeroed);
+    while (page) {
+        desc = pfn_to_struct_page(page_to_pfn((unsigned long)page));
+        page_set_flag(desc, PG_PCP);
+        if (zeroed)
+            page_set_flag(desc, PG_ZEROED);
+        list_add_tail(&pcp->list, page);
+        pcp->count++;
+        if (++i == pcp->batch)
+            break;
+        page = get_page_from_zones(GFP_KERNEL, 0, true, &zeroed);
+    }
+}
+
+/* Give at most nr cold pages back to buddy system. @NOTE: caller must disable interrupts */
+static void pcp_drain(struct per_cpu_pages *pcp, uint32_t nr)
+{
+    struct list *page;
+    struct page *desc;
+    bool zeroed;
+
+    while (nr-- && pcp->count) {
+        page = pcp->list.prev;
+        list_del(page);
+        pcp->count--;
+        desc = pfn_to_struct_page(page_to_pfn((unsigned long)page));
+        zeroed = page_test_flag(desc, PG_ZEROED);
+        page_clear_flag(desc, PG_PCP);
+        page_clear_flag(desc, PG_ZEROED);
+        __free_pages(page, 0, zeroed);
+    }
+}
+
+/* Return all pages cached by local cpu to buddy system */
+void drain_local_pages()
+{
+    unsigned long flags;
+    struct per_cpu_pages *pcp = this_cpu_pcp();
+
+    cli_and_save(flags);
+    pcp_drain(pcp, pcp->count);
+    restore_flags(flags);
+}
+
+static void* __alloc_page()
+{
+    unsigned long flags;
+    struct per_cpu_pages *pcp = this_cpu_pcp();
+    struct list *page = NULL;
+    struct page *desc;
+
+    cli_and_save(flags);
+    if (likely(pcp->count)) {
+        pcp->hit++;
+    } else {
+        pcp->miss++;
+        pcp_refill(pcp);
+        if (!pcp->count) {
+            count_alloc(0, NULL);
+            restore_flags(flags);
+            return NULL;
+        }
+    }
+    page = pcp->list.next;
+    list_del(page);
+    pcp->count--;
+    desc = pfn_to_struct_page(page_to_pfn((unsigned long)page));
+    page_clear_flag(desc, PG_PCP);
+    page_clear_flag(desc, PG_ZEROED);
+    count_alloc(0, page);
+    restore_flags(flags);
+
+    return page;
+}
+
+void* alloc_page()
+{
+    void *page = __alloc_page();
+
+    if (page)
+        mm_debug_alloc(MM_DEBUG_PAGES, page, PAGE_SIZE, __builtin_return_address(0));
+    return page;
+}
+
+/*
+ * Get (1 << order) pages whose content is all zero.
+ * Zeroed blocks are preferred, the block is cleared here only when there is none of them. Single pages are taken
+ * from buddy system too, pcp lists are refilled with dirty pages for alloc_page().
+ */
+void* alloc_pages_zeroed(char order)
+{
+    return buddy_alloc(GFP_KERNEL | __GFP_ZERO, order, __builtin_return_address(0));
+}
+
+/*
+ * Zero one dirty free block, called when cpu is idle.
+ * The block is taken off the free list while it's cleared, so interrupts are not disabled during memset, and
+ * every cpu can zero a different block at the same time.
+ * @return: number of pages zeroed, 0 means all free pages are already zeroed.
+ */
+int zero_free_pages()
+{
+    unsigned long flags;
     struct list *head = NULL;
-    char cur_order = order;
-    panic_on(order < 0 || order >= MAX_ORDER, "invalid request order %d\n", order);
+    char order = -1;
+    pfn_t pfn;
+    int z;
+
+    cli_and_save(flags);
+    for (z = NR_ZONES - 1; z >= 0 && order < 0; --z) {
+        for (order = _MAX_ORDER; order >= 0; --order) {
+            head = get_free_pages_head(&zones[z], order);
+            if (list_empty(head))
+                continue;
+            if (!page_test_flag(pfn_to_struct_page(page_to_pfn((unsigned long)head->next)), PG_ZEROED))
+                break;
+        }
+    }
+    if (order < 0) {
+        restore_flags(flags);
+        return 0;
+    }
+    pfn = page_to_pfn((unsigned long)head->next);
+    del_from_free_list(pfn, order);
+    restore_flags(flags);
 
-    cli();
-    while (cur_order >= 0 && cur_order < MAX_ORDER)  {
-        head = get_free_pages_head(cur_order);
-        if (list_empty(head)) {
-            cur_order++;
-            continue;
+    memset((void*)pfn_to_page(pfn), 0, PAGE_SIZE << order);
+
+    cli_and_save(flags);
+    try_to_merge(pfn, order, true);
+    restore_flags(flags);
+
+    return 1 << order;
+}
+
+static void free_hot_cold_page(void *addr, bool cold)
+{
+    unsigned long flags;
+    struct per_cpu_pages *pcp = this_cpu_pcp();
+    struct page *page = pfn_to_struct_page(page_to_pfn((unsigned long)addr));
+
+    cli_and_save(flags);
+    panic_on(page->flags & ((1 << PG_BUDDY) | (1 << PG_PCP)), "double free page 0x%x\n", addr);
+    page_set_flag(page, PG_PCP);
+    if (cold)
+        list_add_tail(&pcp->list, addr);
+    else
+        list_add_head(&pcp->list, addr);
+    pcp->count++;
+    count_free(0);
+    if (pcp->count >= pcp->high)
+        pcp_drain(pcp, pcp->batch);
+    restore_flags(flags);
+}
+
+void free_page(void *addr)
+{
+    if (mm_debug_free(MM_DEBUG_PAGES, addr, PAGE_SIZE, __builtin_return_address(0), release_pages))
+        return;
+    free_hot_cold_page(addr, false);
+}
+
+/* Free a page which is not expected to be used again soon, e.g. its content will not be touched */
+void free_cold_page(void *addr)
+{
+    if (mm_debug_free(MM_DEBUG_PAGES, addr, PAGE_SIZE, __builtin_return_address(0), release_pages))
+        return;
+    free_hot_cold_page(addr, true);
+}
+
+/*
+ * @NOTE: about contiguous allocation
+ *   Buddy blocks are at most 4M, alloc_contig_pages() gets larger physically contiguous memory by looking for a
+ *   range whose pages are all in free blocks, then takes those blocks off free lists and gives the parts outside
+ *   the range back. Candidate ranges start at a multiple of the request size rounded up to power of 2(at most
+ *   4M), and a failed candidate is skipped past the first page that is not free, so one call is linear in the
+ *   number of pages. Pages in use can't be moved away, so it works best early or for memory which is rarely used.
+ */
+
+/* @return: order of the free block containing pfn, or -1 if pfn is not free. @NOTE: caller must disable interrupts */
+static int free_block_order(pfn_t pfn)
+{
+    int order;
+
+    for (order = 0; order < MAX_ORDER; ++order) {
+        if (page_is_buddy(pfn & ~((1 << order) - 1), order))
+            return order;
+    }
+    return -1;
+}
+
+/*
+ * Give pages [start, end) back to buddy system, merging them with free neighbours
+ * @NOTE: caller must disable interrupts
+ */
+static void free_contig_range(pfn_t start, pfn_t end)
+{
+    char order;
+
+    while (start < end) {
+        order = start ? __ffs(start) : _MAX_ORDER;
+        if (order > _MAX_ORDER)
+            order = _MAX_ORDER;
+        if ((1 << order) > end - start)
+            order = __fls(end - start);
+        __free_pages((void*)pfn_to_page(start), order, false);
+        start += (1 << order);
+    }
+}
+
+/*
+ * Take all free blocks overlapping [start, end) off free lists, keep only [start, end) busy
+ * @NOTE: caller must disable interrupts
+ */
+static void isolate_contig_range(pfn_t start, pfn_t end)
+{
+    pfn_t pfn = start, head;
+    int order;
+
+    while (pfn < end) {
+        order = free_block_order(pfn);
+        head = pfn & ~((1 << order) - 1);
+        del_from_free_list(head, order);
+        pfn = head + (1 << order);
+        page_bitmap_set_range(head, pfn, true);
+        if (head < start)
+            free_contig_range(head, start);
+        if (pfn > end)
+            free_contig_range(end, pfn);
+    }
+}
+
+/* Give the range back when it leaves quarantine of MM_DEBUG, see mm_debug.h */
+static void release_contig_pages(void *addr, uint32_t size)
+{
+    unsigned long flags;
+    pfn_t pfn = page_to_pfn((unsigned long)addr);
+
+    cli_and_save(flags);
+    free_contig_range(pfn, pfn + size / PAGE_SIZE);
+    buddy_stats.used_pages -= size / PAGE_SIZE;
+    restore_flags(flags);
+}
+
+/*
+ * Find nr_pages free pages starting at a multiple of align and take them off free lists
+ * @return: NULL if there is no such free range
+ * @NOTE: caller must disable interrupts
+ */
+static void* __alloc_contig_range(uint32_t nr_pages, uint32_t align)
+{
+    pfn_t start, end, pfn;
+    void *addr = NULL;
+    int i, order;
+
+    for (i = 0; i < nr_mem_regions && !addr; ++i) {
+        start = (mem_regions[i].base / PAGE_SIZE + align - 1) & ~(align - 1);
+        while (!addr && start + nr_pages <= mem_regions[i].end / PAGE_SIZE) {
+            end = start + nr_pages;
+            for (pfn = start; pfn < end; pfn = (pfn & ~((1 << order) - 1)) + (1 << order)) {
+                order = free_block_order(pfn);
+                if (order < 0)
+                    break;
+            }
+            if (pfn >= end) {
+                isolate_contig_range(start, end);
+                addr = (void*)pfn_to_page(start);
+            } else {
+                start = (pfn + align) & ~(align - 1);
+            }
         }
-        /* Found a free pages list */
-        head = head->next;
-        page_bitmap_set_busy(head, order);
-        if (cur_order != order)
-            split_free_pages_list(cur_order, order);
-        list_del(head);
-        phy_mm_stcutre.nr_free_pages[cur_order]--;
-        phy_mm_stcutre.all_free_pages -= (1 << order);
+    }
+    return addr;
+}
 
-        panic_on(((unsigned long)head & PAGE_MASK), "invalid page address 0x%x\n", head);
-        return head;
+/*
+ * Get nr_pages physically contiguous pages, nr_pages can be larger than the biggest buddy block.
+ * The address is aligned to nr_pages rounded up to power of 2, or 4M if that is larger.
+ * @return: NULL if there is no such free range
+ */
+void* alloc_contig_pages(uint32_t nr_pages)
+{
+    struct per_cpu_pages *pcp = this_cpu_pcp();
+    unsigned long flags;
+    uint32_t align;
+    void *addr = NULL;
+
+    if (!nr_pages)
+        return NULL;
+    for (align = 1; align < nr_pages && align < (1 << _MAX_ORDER); align <<= 1)
+        ;
+
+    cli_and_save(flags);
+    /* pages cached in pcp are free too */
+    pcp_drain(pcp, pcp->count);
+    addr = __alloc_contig_range(nr_pages, align);
+    /* shrinkers give back scattered pages, so one more try is all that is worth it */
+    if (!addr && reclaim_pages(gfp_zone(GFP_KERNEL), _MAX_ORDER))
+        addr = __alloc_contig_range(nr_pages, align);
+    if (addr) {
+        buddy_stats.contig_alloc++;
+        buddy_stats.used_pages += nr_pages;
+        if (buddy_stats.used_pages > buddy_stats.peak_used_pages)
+            buddy_stats.peak_used_pages = buddy_stats.used_pages;
+    } else {
+        buddy_stats.contig_fail++;
     }
-    sti();
+    restore_flags(flags);
+
+    if (addr)
+        mm_debug_alloc(MM_DEBUG_PAGES, addr, nr_pages * PAGE_SIZE, __builtin_return_address(0));
+    return addr;
+}
+
+/* Free pages got from alloc_contig_pages(), nr_pages must be the same */
+void free_contig_pages(void *addr, uint32_t nr_pages)
+{
+    if (mm_debug_free(MM_DEBUG_PAGES, addr, nr_pages * PAGE_SIZE, __builtin_return_address(0), release_contig_pages))
+        return;
+    release_contig_pages(addr, nr_pages * PAGE_SIZE);
+}
 
+static inline struct page* user_page(pte_t pte)
+{
+    return pfn_to_struct_page(page_to_pfn(pte & ~PAGE_MASK));
+}
+
+/* @return: pte of addr, or NULL if there is no page table for it */
+static pte_t* lookup_pte(pgd_t *pgd, unsigned long addr)
+{
+    pde_t pde = pgd[get_bits(addr, 22, 31)];
+
+    if (!pde)
+        return NULL;
+    return &((pte_t*)(pde & ~PAGE_MASK))[get_bits(addr, 12, 21)];
+}
+
+/* Drop one reference of a user page, free it when no mm maps it */
+static void put_user_page(pte_t pte)
+{
+    struct page *page = user_page(pte);
+
+    panic_on(!page->count, "put free user page 0x%x\n", pte & ~PAGE_MASK);
+    if (--page->count == 0)
+        free_page((void*)(pte & ~PAGE_MASK));
+}
+
+/*
+ * Share all user pages of old with new. Writable pages become read only in both mm and are copied by
+ * do_wp_page() when one of them writes, so fork costs page tables instead of the whole memory.
+ * @return: 0 if success
+ */
+static int copy_page_tables(struct mm *old, struct mm *new)
+{
+    uint32_t i, j;
+    pte_t *src, *dst;
+
+    for (i = USER_BASE >> 22; i < PAGE_SIZE / sizeof(pgd_t); ++i) {
+        if (!old->pgdir[i])
+            continue;
+        dst = alloc_pgdir();
+        if (!dst)
+            return -ENOMEM;
+        new->pgdir[i] = (uint32_t)dst | (old->pgdir[i] & PAGE_MASK);
+        src = (pte_t*)(old->pgdir[i] & ~PAGE_MASK);
+        for (j = 0; j < PAGE_SIZE / sizeof(pte_t); ++j) {
+            if (!src[j])
+                continue;
+            src[j] &= ~(1 << RW_BIT);
+            dst[j] = src[j];
+            user_page(src[j])->count++;
+        }
+    }
+    new->rss = old->rss;
+    return 0;
+}
+
+/* Duplicate address space of old for fork */
+struct mm* dup_mm(struct mm *old)
+{
+    struct mm *mm = mm_alloc();
+    struct vm_area *vma;
+    struct list *cur;
+
+    if (!mm)
+        return NULL;
+    list_for_each(cur, &old->mmap) {
+        vma = list_entry(cur, struct vm_area, list);
+        if (add_vma(mm, vma->start, vma->end, vma->flags, vma->src))
+            goto fail;
+    }
+    if (copy_page_tables(old, mm))
+        goto fail;
+    /* pages of old were made read only, drop its stale writable TLB entries */
+    if (old == current()->mm)
+        load_cr3(old->pgdir);
+    return mm;
+
+fail:
+    mm_release(mm);
     return NULL;
 }
 
-static void try_to_merge(pfn_t pfn, char order)
+/*
+ * Give new task the address space of old, user pages are shared copy-on-write
+ * @NOTE: new must not have an mm of its own yet, it would be overwritten
+ */
+int copy_mm(struct task_struct *old, struct task_struct *new)
 {
-    pfn_t buddy_pfn = find_buddy_pfn(pfn, order);
-    unsigned long page = pfn * PAGE_SIZE + phy_mem_base;
-    unsigned long buddy_page = buddy_pfn * PAGE_SIZE + phy_mem_base;
-    struct list *head = NULL;
+    /* kernel threads have no user space to copy */
+    if (!old->mm || old->mm == &init_mm) {
+        new->mm = old->mm;
+        return 0;
+    }
+    new->mm = dup_mm(old->mm);
+    return new->mm ? 0 : -ENOMEM;
+}
 
-    while (pages_is_free(buddy_page, order)) {
-        list_del((void*)page);
-        list_del((void*)buddy_page);
-        phy_mm_stcutre.nr_free_pages[order] -= 2;
-        order++;
+void exit_mm(struct task_struct *task)
+{
+    struct mm *mm = task->mm;
+
+    if (!mm || mm == &init_mm)
+        return;
+    task->mm = NULL;
+    if (mm == current()->mm)
+        switch_mm(mm, &init_mm);
+    mm_release(mm);
+}
 
-        phy_mm_stcutre.nr_free_pages[order]++;
-        page = page < buddy_page ? page : buddy_page;
-        head = get_free_pages_head(order);
-        list_add_tail(head, (void*)page);
+/* Get a new address space, kernel mappings are shared with init_mm */
+struct mm* mm_alloc()
+{
+    struct mm *mm = kmem_cache_alloc(mm_cachep);
+
+    if (!mm)
+        return NULL;
+    mm->pgdir = alloc_pgdir();
+    if (!mm->pgdir) {
+        kmem_cache_free(mm_cachep, mm);
+        return NULL;
+    }
+    /* kernel pdes never change after page_table_init(), so copying them once is enough */
+    memcpy(mm->pgdir, init_pgtbl_dir, (USER_BASE >> 22) * sizeof(pgd_t));
+    INIT_LIST(&mm->mmap);
+    mm->nr_vmas = 0;
+    mm->rss = 0;
+    return mm;
+}
 
-        pfn = (page - phy_mem_base) / PAGE_SIZE;
-        buddy_pfn = find_buddy_pfn(pfn, order);
-        buddy_page = buddy_pfn * PAGE_SIZE + phy_mem_base;
+/* Free all user pages, page tables and vm_areas of mm, and mm itself */
+void mm_release(struct mm *mm)
+{
+    struct list *cur, *next;
+    uint32_t i, j;
+    pte_t *pgtbl;
+
+    panic_on(mm == &init_mm, "can't release init_mm\n");
+    for (i = USER_BASE >> 22; i < PAGE_SIZE / sizeof(pgd_t); ++i) {
+        if (!mm->pgdir[i])
+            continue;
+        pgtbl = (pte_t*)(mm->pgdir[i] & ~PAGE_MASK);
+        for (j = 0; j < PAGE_SIZE / sizeof(pte_t); ++j) {
+            if (pgtbl[j])
+                put_user_page(pgtbl[j]);
+        }
+        free_page(pgtbl);
     }
+    free_page(mm->pgdir);
+
+    for (cur = mm->mmap.next; !list_is_head(cur, &mm->mmap); cur = next) {
+        next = cur->next;
+        kmem_cache_free(vma_cachep, list_entry(cur, struct vm_area, list));
+    }
+    kmem_cache_free(mm_cachep, mm);
 }
 
-/* Return (1 << order) pages to buddy system */
-void free_pages(void *addr, char order)
+/*
+ * Add [start, end) to the address space of mm, no page is allocated until it is touched.
+ * @src: if not 0, content of the area is copied from kernel memory at src on demand
+ */
+int add_vma(struct mm *mm, unsigned long start, unsigned long end, uint32_t flags, unsigned long src)
 {
-    cli();
-    pfn_t pfn = (unsigned long)(addr - phy_mem_base)/PAGE_SIZE;
-    struct list *head = NULL;
-    INIT_LIST(addr);
+    struct vm_area *vma;
+    struct list *cur;
 
-    panic_on(order < 0 || order > MAX_ORDER, "invalid order %d\n", order);
-    phy_mm_stcutre.all_free_pages += (1 << order);
-    phy_mm_stcutre.nr_free_pages[order]++;
-    head = get_free_pages_head(order);
-    list_add_tail(head, addr);
-    page_bitmap_set_free(addr, order);
-    try_to_merge(pfn, order);
-    sti();
+    if ((start & PAGE_MASK) || (end & PAGE_MASK) || start >= end || start < USER_BASE || end > USER_END)
+        return -EINVAL;
+
+    list_for_each(cur, &mm->mmap) {
+        vma = list_entry(cur, struct vm_area, list);
+        if (start < vma->end && vma->start < end)
+            return -EEXIST;
+        if (vma->start >= end)
+            break;
+    }
+
+    vma = kmem_cache_alloc(vma_cachep);
+    if (!vma)
+        return -ENOMEM;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->src = src;
+    /* insert before the first area above it, so the list is sorted */
+    __list_add(cur->prev, cur, &vma->list);
+    mm->nr_vmas++;
+    return 0;
 }
 
-void* alloc_page()
+struct vm_area* find_vma(struct mm *mm, unsigned long addr)
 {
-    return alloc_pages(0);
+    struct vm_area *vma;
+    struct list *cur;
+
+    list_for_each(cur, &mm->mmap) {
+        vma = list_entry(cur, struct vm_area, list);
+        if (addr < vma->start)
+            break;
+        if (addr < vma->end)
+            return vma;
+    }
+    return NULL;
 }
 
-void free_page(void *addr)
+/* @return: whether [addr, addr + n) of current mm is in vm_areas with all of the flags */
+static bool user_range_ok(unsigned long addr, uint32_t n, uint32_t flags)
 {
-    free_pages(addr, 0);
+    struct mm *mm = current()->mm;
+    unsigned long end = addr + n;
+    struct vm_area *vma;
+
+    if (!mm || addr < USER_BASE || end > USER_END || end < addr)
+        return false;
+    while (addr < end) {
+        vma = find_vma(mm, addr);
+        if (!vma || (vma->flags & flags) != flags)
+            return false;
+        addr = vma->end;
+    }
+    return true;
 }
 
-void copy_mm(struct task_struct *old, struct task_struct *new)
+/*
+ * Copy n bytes to user address to of current mm, like user program writes them: pages not touched yet are
+ * allocated and pages shared by fork are copied by page fault handler.
+ * @return: 0 if success, -EFAULT if part of [to, to + n) is not in a writable vm_area
+ */
+int copy_to_user(void *to, const void *from, uint32_t n)
 {
-    new->mm->pgdir = alloc_pgdir();
+    if (!user_range_ok((unsigned long)to, n, VM_WRITE))
+        return -EFAULT;
+    memcpy(to, from, n);
+    return 0;
 }
 
-/* page fault, with error code  */
-void page_fault_handler()
+/*
+ * Copy n bytes from user address from of current mm
+ * @return: 0 if success, -EFAULT if part of [from, from + n) is not in a readable vm_area
+ */
+int copy_from_user(void *to, const void *from, uint32_t n)
 {
-    unsigned long addr = 0;
-    asm volatile ("movl %%cr2, %0":"=r"(addr)::);
-    addr &= ~PAGE_MASK;
-    KERN_INFO("page fault occured addr: 0x%x\n", addr);
-    if (!init_finish) {
-        add_page_mapping(addr,addr);
+    if (!user_range_ok((unsigned long)from, n, VM_READ))
+        return -EFAULT;
+    memcpy(to, from, n);
+    return 0;
+}
+
+void switch_mm(struct mm *prev, struct mm *next)
+{
+    /* kernel mappings are global, reloading CR3 only flushes user mappings */
+    if (prev != next)
+        load_cr3(next->pgdir);
+}
+
+/*
+ * Allocate a page for addr in vma and map it.
+ * @return: 0 if success
+ */
+static int do_anonymous_page(struct mm *mm, struct vm_area *vma, unsigned long addr)
+{
+    uint32_t flags = (1 << PRESENT_BIT) | (1 << US_BIT);
+    void *page;
+
+    if (vma->src) {
+        page = alloc_page();
+        if (!page)
+            return -ENOMEM;
+        memcpy(page, (void*)(vma->src + addr - vma->start), PAGE_SIZE);
     } else {
-        // todo: here may be a infini loop
-        void *p = alloc_page();
+        page = alloc_pages_zeroed(0);
+        if (!page)
+            return -ENOMEM;
+    }
+    if (vma->flags & VM_WRITE)
+        flags |= (1 << RW_BIT);
+    pfn_to_struct_page(page_to_pfn((unsigned long)page))->count = 1;
+    add_page_mapping(mm->pgdir, addr, (uint32_t)page, flags);
+    mm->rss++;
+    return 0;
+}
+
+/*
+ * Write to a page shared by fork. The last mm mapping it takes it over, others get a private copy.
+ * @return: 0 if success
+ */
+static int do_wp_page(struct mm *mm, unsigned long addr)
+{
+    pte_t *pte = lookup_pte(mm->pgdir, addr);
+    void *page;
+
+    if (!pte || !CHECK_FLAG(*pte, PRESENT_BIT))
+        return -EFAULT;
+    if (user_page(*pte)->count > 1) {
+        page = alloc_page();
+        if (!page)
+            return -ENOMEM;
+        memcpy(page, (void*)(*pte & ~PAGE_MASK), PAGE_SIZE);
+        pfn_to_struct_page(page_to_pfn((unsigned long)page))->count = 1;
+        put_user_page(*pte);
+        *pte = (uint32_t)page | (*pte & PAGE_MASK);
     }
+    *pte |= (1 << RW_BIT);
+    invlpg(addr);
+    return 0;
+}
+
+static const char* page_fault_reason(uint32_t error_code)
+{
+    if (CHECK_FLAG(error_code, PF_RSVD))
+        return "reserved bit set";
+    if (!CHECK_FLAG(error_code, PF_PROT))
+        return "page not present";
+    if (CHECK_FLAG(error_code, PF_WRITE))
+        return "write to read only page";
+    if (CHECK_FLAG(error_code, PF_USER))
+        return "user access to kernel page";
+    return "protection violation";
 }
 
+/* page fault, with error code  */
+void page_fault_handler(struct intr_frame *frame)
+{
+    unsigned long addr = 0;
+    struct mm *mm = current()->mm;
+    struct vm_area *vma = NULL;
+    uint32_t error = frame->error_code;
+
+    /* paging is enabled after init_tasks(), so current() always has a valid mm here */
+    asm volatile ("movl %%cr2, %0":"=r"(addr)::);
+
+    /*
+     * Only a missing page in a vm_area, or a write to a page shared by fork can be fixed, everything else is a
+     * bug of kernel or user program
+     */
+    if (addr >= USER_BASE && !CHECK_FLAG(error, PF_RSVD))
+        vma = find_vma(mm, addr);
+    if (vma && CHECK_FLAG(error, PF_WRITE) && !(vma->flags & VM_WRITE))
+        vma = NULL;
+    if (vma && CHECK_FLAG(error, PF_INSTR) && !(vma->flags & VM_EXEC))
+        vma = NULL;
+    if (vma && !CHECK_FLAG(error, PF_PROT) && !do_anonymous_page(mm, vma, addr & ~PAGE_MASK))
+        return;
+    if (vma && CHECK_FLAG(error, PF_PROT) && CHECK_FLAG(error, PF_WRITE) && !do_wp_page(mm, addr & ~PAGE_MASK))
+        return;
+
+    panic("%s page fault at 0x%x: %s, %s, eip 0x%x\n",
+          CHECK_FLAG(error, PF_USER) ? "user" : "kernel", addr, page_fault_reason(error),
+          CHECK_FLAG(error, PF_WRITE) ? "write" : "read", frame->eip);
+}
 
 void liballoc_lock(unsigned long *flags)
 {
@@ -607,7 +2012,6 @@ void liballoc_lock(unsigned long *flags)
 
 void liballoc_unlock(unsigned long flags)
 {
-    sti();
     restore_flags(flags);
 }
 
@@ -616,7 +2020,12 @@ void* liballoc_alloc(size_t order)
     return alloc_pages(order);
 }
 
-void liballoc_free(void *addr, size_t order)
+/*
+ * liballoc passes the number of pages, which is always a power of 2
+ * @NOTE: kfree() has already kept the block in quarantine of MM_DEBUG, it's not quarantined again as pages
+ */
+void liballoc_free(void *addr, size_t pages)
 {
-    free_pages(addr, order);
+    mm_debug_free_released(MM_DEBUG_PAGES, addr, pages * PAGE_SIZE, __builtin_return_address(0));
+    release_pages(addr, pages * PAGE_SIZE);
 }
\ No newline at end of file
@@ -4,46 +4,263 @@
 #include "multiboot.h"
 #include "types.h"
 #include "list.h"
+#include "lib.h"
 #include "liballoc.h"
 
 #define PAGE_SIZE 4096
 #define PAGE_MASK (PAGE_SIZE-1)
 
-#define SLOTS 4096*4
 #define _MAX_ORDER 10
 #define MAX_ORDER (_MAX_ORDER+1)    // max free list is 4M(4K * 2^10)
 
+#define LARGE_PAGE_SIZE (PAGE_SIZE << _MAX_ORDER)  // 4M page mapped by one pde, same size as an order-10 block
+#define LARGE_PAGE_MASK (LARGE_PAGE_SIZE-1)
+
 extern int init_paging(unsigned long addr);
 extern void enable_paging();
 
 extern void* alloc_pages(char order);
 extern void free_pages(void* addr, char order);
 extern void* alloc_page();
+extern void* alloc_pages_zeroed(char order);
+extern int zero_free_pages();
 extern void free_page(void* addr);
+extern void free_cold_page(void *addr);
+extern void drain_local_pages();
+extern void* alloc_contig_pages(uint32_t nr_pages);
+extern void free_contig_pages(void *addr, uint32_t nr_pages);
 extern void mm_show_statistics(uint32_t ret[MAX_ORDER]);
 
+/*
+ * @NOTE: about zones
+ *   ZONE_DMA is physical memory below 16M, which is all that ISA DMA(floppy and old hard disk controllers) can
+ *   reach. ZONE_NORMAL is the rest. Every zone has its own free lists and watermarks, an allocation takes pages
+ *   from the zone picked by gfp flags, and falls back to lower zones only if that zone is short of memory.
+ */
+#define ZONE_DMA    0
+#define ZONE_NORMAL 1
+#define NR_ZONES    2
+#define MAX_DMA_ADDRESS 0x1000000
+
+typedef uint32_t gfp_t;
+#define __GFP_DMA   (1 << 0)    // only from ZONE_DMA
+#define __GFP_ZERO  (1 << 1)    // content of the block must be zero
+#define GFP_KERNEL  0           // ZONE_NORMAL first, then ZONE_DMA
+#define GFP_DMA     __GFP_DMA
+
+extern void* __alloc_pages(gfp_t gfp, char order);
+
+/*
+ * Free page watermarks of every zone, see reclaim_pages().
+ * Below low, allocations run shrinkers until free pages are back above high. Min is the level at which
+ * shrinkers are asked for everything they have.
+ */
+#define WMARK_MIN  0
+#define WMARK_LOW  1
+#define WMARK_HIGH 2
+#define NR_WMARK   3
+
+/*
+ * Counters of buddy system since boot, see mm_get_stats().
+ * Pages handed out through pcp are counted as order-0 allocations, moving pages between pcp and buddy is not.
+ * frag_index[order] is the unusable free space index in permille: the part of free pages which are in blocks
+ * smaller than order, 0 means every free page can serve a request of order, 1000 means none can.
+ */
+struct buddy_stats {
+    uint32_t alloc[MAX_ORDER];
+    uint32_t free[MAX_ORDER];
+    uint32_t fail[MAX_ORDER];
+    uint32_t split[MAX_ORDER];      // blocks of this order split into two halves
+    uint32_t merge[MAX_ORDER];      // blocks of this order merged with their buddies
+    uint32_t nr_free[MAX_ORDER];    // free blocks of this order now
+    uint32_t frag_index[MAX_ORDER];
+
+    uint32_t total_pages;           // pages managed by buddy system, reserved pages are not included
+    uint32_t free_pages;            // pages in buddy system, not including those cached in pcp
+    uint32_t zeroed_pages;
+    uint32_t pcp_pages;
+    uint32_t used_pages;            // pages allocated and not freed yet
+    uint32_t peak_used_pages;
+    uint32_t pcp_hit;
+    uint32_t pcp_miss;
+    uint32_t contig_alloc;          // successful alloc_contig_pages()
+    uint32_t contig_fail;
+    uint32_t reclaimed;             // pages given back by shrinkers
+    uint32_t pressure;              // allocations that went to the slow path, see reclaim_pages()
+    uint32_t zone_free[NR_ZONES];   // free pages of each zone, they add up to free_pages
+    uint32_t watermark[NR_ZONES][NR_WMARK];
+};
+
+extern void mm_get_stats(struct buddy_stats *stats);
+
+/*
+ * A shrinker gives memory cached by its subsystem back to buddy system when free memory runs low.
+ * shrink() is called with interrupts disabled, it should try to free nr_pages pages(freeing more or less is fine)
+ * and return the number of pages it has given back. Shrinkers are called in the order they are registered.
+ */
+struct shrinker {
+    const char *name;
+    uint32_t (*shrink)(uint32_t nr_pages);
+    struct list list;
+};
+
+extern void register_shrinker(struct shrinker *shrinker);
+extern void unregister_shrinker(struct shrinker *shrinker);
+extern bool mm_under_pressure();
+extern void set_watermark_boost(int zone, uint32_t pages);
+
 typedef uint32_t pgd_t;
 typedef uint32_t pde_t;
 typedef uint32_t pte_t;
 typedef uint32_t pfn_t; // page frame number
 
+extern int add_page_mapping(pgd_t *pgd, uint32_t linear_addr, uint32_t phy_addr, uint32_t flags);
+extern int add_large_page_mapping(pgd_t *pgd, uint32_t linear_addr, uint32_t phy_addr, uint32_t flags);
+extern bool pge_supported();
+
+/*
+ * Metadata of a physical page frame, there is one entry per pfn in mem_map.
+ * Only the first page of a free block in buddy system has PG_BUDDY set, and order records the size of that block.
+ */
+struct page {
+    uint8_t flags;
+    uint8_t order;
+    uint8_t region;     // index of the memory region this page belongs to
+    uint16_t count;     // number of mm mapping this user page, shared pages are copied on write
+};
+
+#define PG_BUDDY 0  // page is the head of a free block in buddy system
+#define PG_PCP   1  // page is cached in a per cpu pages list
+#define PG_ZEROED 2 // content of the free block(or the cached page) is known to be zero
+#define PG_SLAB   3 // page belongs to a slab, order is the order of the slab, see slab.c
+#define PG_KMALLOC 4 // first page of a large kmalloc block, order is the order of the block, see liballoc.c
+
+extern struct page *mem_map;
+
+/* Kernel memory is identity mapped, so kernel address is also physical address */
+static inline struct page* virt_to_page(const void *addr)
+{
+    return &mem_map[(unsigned long)addr / PAGE_SIZE];
+}
+
+static inline bool page_test_flag(struct page *page, int flag)
+{
+    return CHECK_FLAG(page->flags, flag) != 0;
+}
+
+static inline void page_set_flag(struct page *page, int flag)
+{
+    page->flags |= (1 << flag);
+}
+
+static inline void page_clear_flag(struct page *page, int flag)
+{
+    page->flags &= ~(1 << flag);
+}
+
 extern pgd_t *init_pgtbl_dir;
 
 #define PRESENT_BIT 0
 #define RW_BIT 1    // 0 read only, 1 read & write
 #define US_BIT 2    // User/supervisor; if 0, user-mode accesses are not allowed to the 4-KByte page referenced by this entry
-#define PWT_BIT 3   // Page-level write-through. Not used
-#define PCD_BIT 4   // Page-level cache disable. Not used
+#define PWT_BIT 3   // Page-level write-through. Only used by fixmap
+#define PCD_BIT 4   // Page-level cache disable. Only used by fixmap
 #define ACCESS_BIT 5 // Accessed;indicates whether this entry has been used for linear-address translation
 #define DIRTY_BIT 6  // Only used in pde. Dirty;
                     //  indicates whether software has written to the 4-KByte page referenced by this entry
-#define PS_BIT 7     // determine that if there is a 4M huge page, we always set to 0, means we disable 4M page
-#define GLOBAL_BIT 8 // global page. Not used
+#define PS_BIT 7     // Only used in pde. 1 means pde maps a 4M page directly instead of pointing to a page table
+#define GLOBAL_BIT 8 // global page, TLB entry is not flushed when CR3 is reloaded if CR4.PGE = 1
+
+#define PAGE_KERNEL ((1 << PRESENT_BIT) | (1 << RW_BIT) | (1 << GLOBAL_BIT))
+
+#define X86_CR4_PSE (1 << 4)
+#define X86_CR4_PAE (1 << 5)
+#define X86_CR4_PGE (1 << 7)
+
+static inline uint32_t read_cr4()
+{
+    uint32_t cr4;
+    asm volatile ("movl %%cr4, %0":"=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint32_t cr4)
+{
+    asm volatile ("movl %0, %%cr4"::"r"(cr4):"memory");
+}
+
+/* Flush TLB entry of one page */
+static inline void invlpg(unsigned long addr)
+{
+    asm volatile ("invlpg (%0)"::"r"(addr):"memory");
+}
+
+/* Reloading CR3 flushes all TLB entries except global ones */
+static inline void load_cr3(pgd_t *pgd)
+{
+    asm volatile ("movl %0, %%cr3"::"r"(pgd):"memory");
+}
 
 #define page_fault_handler intr0xE_handler
 
+/* Page fault error code */
+#define PF_PROT  0  // 0 the page is not present, 1 protection violation
+#define PF_WRITE 1  // 0 read access, 1 write access
+#define PF_USER  2  // 0 fault in kernel mode, 1 fault in user mode
+#define PF_RSVD  3  // reserved bit is set in paging structure
+#define PF_INSTR 4  // fault caused by instruction fetch
+
+/*
+ * @NOTE: about address space
+ *   [0, USER_BASE) is identity mapped physical memory shared by all page directories, only kernel can access it.
+ *   [USER_BASE, USER_END) is private to each mm, pages are allocated and mapped when they are touched the first
+ *   time, as long as the address is in a vm_area of the mm.
+ */
+#define USER_BASE       0xC0000000
+#define USER_END        0xFF000000
+#define USER_STACK_TOP  USER_END
+#define USER_STACK_SIZE (1 << 20)
+
+#define VM_READ  (1 << 0)
+#define VM_WRITE (1 << 1)
+#define VM_EXEC  (1 << 2)
+
+struct vm_area {
+    unsigned long start;    // page aligned
+    unsigned long end;      // page aligned, not included
+    uint32_t flags;
+    unsigned long src;      // if not 0, pages are filled from kernel memory at src when they are mapped
+    struct list list;       // sorted by start
+};
+
 struct mm {
     pgd_t *pgdir;    // top level pgdir
+    struct list mmap;   // list of vm_area
+    uint32_t nr_vmas;
+    uint32_t rss;       // number of user pages mapped
 };
 
+/*
+ * @NOTE: about fixmap
+ *   The last 4M below USER_BASE is not identity mapped, its pages map memory mapped io(e.g. registers of local APIC)
+ *   at fixed kernel addresses. Its page table is set up by page_table_init(), so every mm shares the mappings.
+ */
+#define FIXADDR_START   (USER_BASE - LARGE_PAGE_SIZE)
+#define FIX_APIC_BASE   0
+#define NR_FIXMAPS      1
+#define fix_to_virt(idx) (FIXADDR_START + (idx) * PAGE_SIZE)
+
+extern void set_fixmap(int idx, uint32_t phy_addr);
+
+extern struct mm init_mm;
+
+extern struct mm* mm_alloc();
+extern struct mm* dup_mm(struct mm *old);
+extern void mm_release(struct mm *mm);
+extern int add_vma(struct mm *mm, unsigned long start, unsigned long end, uint32_t flags, unsigned long src);
+extern struct vm_area* find_vma(struct mm *mm, unsigned long addr);
+extern void switch_mm(struct mm *prev, struct mm *next);
+extern int copy_to_user(void *to, const void *from, uint32_t n);
+extern int copy_from_user(void *to, const void *from, uint32_t n);
+
 #endif
\ No newline at end of file
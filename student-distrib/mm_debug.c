@@ -0,0 +1,287 @@
+#ifdef MM_DEBUG
+#include "mm_debug.h"
+#include "mm.h"
+#include "lib.h"
+
+/*
+ * @NOTE: about allocation records
+ *   Records live in a static table, so recording doesn't allocate memory from the allocators being checked.
+ *   They are hashed by address, record index + 1 is stored in buckets and next, so 0 means the end of chain and
+ *   zeroed bss is a valid empty table. When the table is full, allocations are not recorded any more, and freeing
+ *   an unknown block is no longer treated as a bug.
+ */
+#define MM_DEBUG_RECORDS    8192
+#define MM_DEBUG_BUCKETS    1024
+#define QUARANTINE_SLOTS    256
+#define QUARANTINE_BYTES    (1 << 20)   // larger blocks are poisoned but not kept in quarantine
+#define MAX_DUMP_CALLERS    64
+
+struct alloc_record {
+    unsigned long addr;
+    uint32_t size;
+    void *caller;
+    uint16_t next;
+    uint8_t type;
+};
+
+struct quarantine_entry {
+    void *addr;
+    uint32_t size;
+    void *caller;   // who freed the block
+    mm_release_t release;
+    uint8_t type;
+};
+
+static const char *type_name[] = { "pages", "kmalloc block" };
+
+static struct alloc_record records[MM_DEBUG_RECORDS];
+static uint16_t buckets[MM_DEBUG_BUCKETS];
+static uint16_t free_records;
+static uint32_t nr_records;     // records that have ever been used
+static uint32_t nr_outstanding;
+static uint32_t nr_untracked;   // allocations not recorded because the table was full
+
+/* ring buffer, the oldest entry is at q_head */
+static struct quarantine_entry quarantine[QUARANTINE_SLOTS];
+static uint32_t q_head;
+static uint32_t q_count;
+static uint32_t q_bytes;
+
+static inline uint32_t addr_hash(unsigned long addr)
+{
+    return ((addr >> 4) ^ (addr >> 12)) & (MM_DEBUG_BUCKETS - 1);
+}
+
+/* @return: the link pointing to the record of addr, or the link at the end of chain if there is none */
+static uint16_t* find_record(int type, unsigned long addr)
+{
+    uint16_t *link = &buckets[addr_hash(addr)];
+    struct alloc_record *record;
+
+    while (*link) {
+        record = &records[*link - 1];
+        if (record->addr == addr && record->type == type)
+            break;
+        link = &record->next;
+    }
+    return link;
+}
+
+static struct quarantine_entry* find_in_quarantine(int type, void *addr)
+{
+    uint32_t i;
+    struct quarantine_entry *entry;
+
+    for (i = 0; i < q_count; ++i) {
+        entry = &quarantine[(q_head + i) % QUARANTINE_SLOTS];
+        if (entry->addr == addr && entry->type == type)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Check the poison of the oldest block in quarantine and really free it. @NOTE: caller must disable interrupts */
+static void quarantine_evict()
+{
+    struct quarantine_entry entry = quarantine[q_head];
+    uint8_t *p = entry.addr;
+    uint32_t i;
+
+    /* take it out first, release() may free more blocks and come back here */
+    q_head = (q_head + 1) % QUARANTINE_SLOTS;
+    q_count--;
+    q_bytes -= entry.size;
+
+    for (i = 0; i < entry.size; ++i) {
+        panic_on(p[i] != MM_DEBUG_POISON, "use after free: %s 0x%x freed by 0x%x, offset %u is 0x%x\n",
+                 type_name[entry.type], entry.addr, entry.caller, i, p[i]);
+    }
+    entry.release(entry.addr, entry.size);
+}
+
+/* Evict blocks until nr_pages pages are freed or quarantine is empty, blocks smaller than a page count as none */
+static uint32_t quarantine_shrink(uint32_t nr_pages)
+{
+    uint32_t freed = 0;
+
+    while (q_count && freed < nr_pages) {
+        freed += quarantine[q_head].size / PAGE_SIZE;
+        quarantine_evict();
+    }
+    return freed;
+}
+
+static struct shrinker quarantine_shrinker = { "mm_debug quarantine", quarantine_shrink };
+
+/* Quarantine holds up to QUARANTINE_BYTES freed memory, which is given back first under memory pressure */
+void mm_debug_init()
+{
+    register_shrinker(&quarantine_shrinker);
+}
+
+void mm_debug_alloc(int type, void *addr, uint32_t size, void *caller)
+{
+    struct alloc_record *record;
+    unsigned long flags;
+    uint16_t *link;
+    uint16_t idx;
+
+    cli_and_save(flags);
+    link = find_record(type, (unsigned long)addr);
+    panic_on(*link, "%s 0x%x is allocated again by 0x%x, it was allocated by 0x%x\n",
+             type_name[type], addr, caller, records[*link - 1].caller);
+    if (free_records) {
+        idx = free_records;
+        free_records = records[idx - 1].next;
+    } else if (nr_records < MM_DEBUG_RECORDS) {
+        idx = ++nr_records;
+    } else {
+        nr_untracked++;
+        restore_flags(flags);
+        return;
+    }
+
+    record = &records[idx - 1];
+    record->addr = (unsigned long)addr;
+    record->size = size;
+    record->caller = caller;
+    record->type = type;
+    record->next = 0;
+    *link = idx;
+    nr_outstanding++;
+    restore_flags(flags);
+}
+
+/*
+ * Check the block is allocated with the same size and drop its record
+ * @return: false if the block is not recorded, which is fine only when the table has been full
+ * @NOTE: caller must disable interrupts
+ */
+static bool drop_record(int type, void *addr, uint32_t size, void *caller)
+{
+    struct quarantine_entry *entry;
+    struct alloc_record *record;
+    uint16_t *link;
+    uint16_t idx;
+
+    link = find_record(type, (unsigned long)addr);
+    if (!*link) {
+        entry = find_in_quarantine(type, addr);
+        panic_on(entry, "double free of %s 0x%x by 0x%x, it was freed by 0x%x\n",
+                 type_name[type], addr, caller, entry->caller);
+        panic_on(!nr_untracked, "free %s 0x%x by 0x%x, which is not allocated\n", type_name[type], addr, caller);
+        return false;
+    }
+
+    idx = *link;
+    record = &records[idx - 1];
+    panic_on(record->size != size, "free %s 0x%x of %u bytes by 0x%x, but %u bytes were allocated by 0x%x\n",
+             type_name[type], addr, size, caller, record->size, record->caller);
+    *link = record->next;
+    record->next = free_records;
+    free_records = idx;
+    nr_outstanding--;
+    return true;
+}
+
+/*
+ * Check the block is allocated with the same size, then poison it and put it into quarantine.
+ * @return: true if the block is kept in quarantine, it's freed by release() later
+ */
+bool mm_debug_free(int type, void *addr, uint32_t size, void *caller, mm_release_t release)
+{
+    struct quarantine_entry *entry;
+    unsigned long flags;
+
+    cli_and_save(flags);
+    if (!drop_record(type, addr, size, caller)) {
+        restore_flags(flags);
+        return false;
+    }
+
+    memset(addr, MM_DEBUG_POISON, size);
+    if (size > QUARANTINE_BYTES) {
+        restore_flags(flags);
+        return false;
+    }
+    while (q_count == QUARANTINE_SLOTS || q_bytes + size > QUARANTINE_BYTES)
+        quarantine_evict();
+
+    entry = &quarantine[(q_head + q_count) % QUARANTINE_SLOTS];
+    entry->addr = addr;
+    entry->size = size;
+    entry->caller = caller;
+    entry->release = release;
+    entry->type = type;
+    q_count++;
+    q_bytes += size;
+    restore_flags(flags);
+
+    return true;
+}
+
+/* Check and drop the record of a block which has left quarantine as a block of another type, it's freed at once */
+void mm_debug_free_released(int type, void *addr, uint32_t size, void *caller)
+{
+    unsigned long flags;
+
+    cli_and_save(flags);
+    drop_record(type, addr, size, caller);
+    restore_flags(flags);
+}
+
+uint32_t mm_debug_outstanding()
+{
+    return nr_outstanding;
+}
+
+/* Print outstanding allocations, grouped by type and caller */
+void mm_debug_dump()
+{
+    struct {
+        void *caller;
+        uint8_t type;
+        uint32_t count;
+        uint32_t bytes;
+    } callers[MAX_DUMP_CALLERS];
+    struct alloc_record *record;
+    uint32_t nr_callers = 0, other = 0;
+    unsigned long flags;
+    uint32_t i, j;
+    uint16_t idx;
+
+    cli_and_save(flags);
+    for (i = 0; i < MM_DEBUG_BUCKETS; ++i) {
+        for (idx = buckets[i]; idx; idx = record->next) {
+            record = &records[idx - 1];
+            for (j = 0; j < nr_callers; ++j) {
+                if (callers[j].caller == record->caller && callers[j].type == record->type)
+                    break;
+            }
+            if (j == nr_callers) {
+                if (nr_callers == MAX_DUMP_CALLERS) {
+                    other++;
+                    continue;
+                }
+                callers[j].caller = record->caller;
+                callers[j].type = record->type;
+                callers[j].count = 0;
+                callers[j].bytes = 0;
+                nr_callers++;
+            }
+            callers[j].count++;
+            callers[j].bytes += record->size;
+        }
+    }
+    printf("mm_debug: %u outstanding allocations, %u not recorded, %u blocks(%u bytes) in quarantine\n",
+           nr_outstanding, nr_untracked, q_count, q_bytes);
+    restore_flags(flags);
+
+    for (j = 0; j < nr_callers; ++j) {
+        printf("mm_debug: %s by 0x%x: %u blocks, %u bytes\n",
+               type_name[callers[j].type], callers[j].caller, callers[j].count, callers[j].bytes);
+    }
+    if (other)
+        printf("mm_debug: %u blocks of other callers\n", other);
+}
+#endif
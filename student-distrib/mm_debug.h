@@ -0,0 +1,59 @@
+#ifndef _MM_DEBUG_H
+#define _MM_DEBUG_H
+
+#include "types.h"
+
+/*
+ * @NOTE: about MM_DEBUG
+ *   Build with `CFLAGS=-DMM_DEBUG make` to check every alloc_pages/free_pages and kmalloc/kfree:
+ *   1. Every allocation is recorded with its size and the address of its caller, freeing a block which is not
+ *      recorded(double free, or a bad pointer) or with another size panics, see mm_debug_free().
+ *   2. Freed blocks are filled with MM_DEBUG_POISON and kept in a quarantine for a while before they are really
+ *      freed, if the poison was overwritten when a block leaves quarantine, it was used after free.
+ *   3. mm_debug_dump() prints the callers of outstanding allocations, which are where leaks come from.
+ *   Without MM_DEBUG everything here is an empty inline function.
+ */
+#define MM_DEBUG_PAGES   0  // blocks of buddy system, size is (PAGE_SIZE << order)
+#define MM_DEBUG_KMALLOC 1  // blocks of kmalloc, size is the usable size of block
+#define MM_DEBUG_POISON  0x6b
+
+/* Really free the block when it leaves quarantine */
+typedef void (*mm_release_t)(void *addr, uint32_t size);
+
+#ifdef MM_DEBUG
+extern void mm_debug_init();
+extern void mm_debug_alloc(int type, void *addr, uint32_t size, void *caller);
+extern bool mm_debug_free(int type, void *addr, uint32_t size, void *caller, mm_release_t release);
+extern void mm_debug_free_released(int type, void *addr, uint32_t size, void *caller);
+extern uint32_t mm_debug_outstanding();
+extern void mm_debug_dump();
+#else
+static inline void mm_debug_init()
+{
+}
+
+static inline void mm_debug_alloc(int type, void *addr, uint32_t size, void *caller)
+{
+}
+
+/* @return: true if the block is kept in quarantine, caller must not free it */
+static inline bool mm_debug_free(int type, void *addr, uint32_t size, void *caller, mm_release_t release)
+{
+    return false;
+}
+
+static inline void mm_debug_free_released(int type, void *addr, uint32_t size, void *caller)
+{
+}
+
+static inline uint32_t mm_debug_outstanding()
+{
+    return 0;
+}
+
+static inline void mm_debug_dump()
+{
+}
+#endif
+
+#endif
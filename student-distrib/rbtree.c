@@ -0,0 +1,229 @@
+#include "rbtree.h"
+
+/*
+ * @reference:
+ *  1. Introduction to Algorithms, chapter 13, Cormen, Leiserson, Rivest and Stein
+ */
+
+static inline bool is_black(struct rb_node *node)
+{
+    return !node || node->color == RB_BLACK;
+}
+
+/* Put new in place of old under old's parent */
+static inline void replace_child(struct rb_node *old, struct rb_node *new, struct rb_node *parent,
+                                 struct rb_root *root)
+{
+    if (!parent)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rotate_left(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if (right->left)
+        right->left->parent = node;
+    right->parent = node->parent;
+    replace_child(node, right, node->parent, root);
+    right->left = node;
+    node->parent = right;
+}
+
+static void rotate_right(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right)
+        left->right->parent = node;
+    left->parent = node->parent;
+    replace_child(node, left, node->parent, root);
+    left->right = node;
+    node->parent = left;
+}
+
+/* Rebalance after a red node is linked, so that no red node has a red child */
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle, *tmp;
+
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        /* parent is red, so it isn't root and gparent exists */
+        gparent = parent->parent;
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (!is_black(uncle)) {
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(gparent, root);
+        } else {
+            uncle = gparent->left;
+            if (!is_black(uncle)) {
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(parent, root);
+                tmp = parent;
+                parent = node;
+                node = tmp;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/* A black node has been removed above node(may be NULL) whose parent is parent, restore black height */
+static void erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+    struct rb_node *sibling;
+
+    while (is_black(node) && node != root->node) {
+        if (parent->left == node) {
+            sibling = parent->right;
+            if (!is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(sibling, root);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(parent, root);
+        } else {
+            sibling = parent->left;
+            if (!is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(sibling, root);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(parent, root);
+        }
+        node = root->node;
+        break;
+    }
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent, *next;
+    int color;
+
+    if (node->left && node->right) {
+        /* the successor has no left child, it takes the place and color of node */
+        next = node->right;
+        while (next->left)
+            next = next->left;
+        child = next->right;
+        parent = next->parent;
+        color = next->color;
+
+        if (child)
+            child->parent = parent;
+        if (parent == node) {
+            parent = next;
+        } else {
+            parent->left = child;
+            next->right = node->right;
+            node->right->parent = next;
+        }
+        next->parent = node->parent;
+        next->color = node->color;
+        next->left = node->left;
+        node->left->parent = next;
+        replace_child(node, next, node->parent, root);
+    } else {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child)
+            child->parent = parent;
+        replace_child(node, child, parent, root);
+    }
+
+    if (color == RB_BLACK)
+        erase_color(child, parent, root);
+}
+
+/* @return: the smallest node, NULL if tree is empty */
+struct rb_node* rb_first(struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+/* @return: the next node in order, NULL if node is the last one */
+struct rb_node* rb_next(struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    while ((parent = node->parent) && node == parent->right)
+        node = parent;
+    return parent;
+}
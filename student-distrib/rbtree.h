@@ -0,0 +1,52 @@
+#ifndef _RBTREE_H
+#define _RBTREE_H
+
+#include "types.h"
+#include "container_of.h"
+
+/*
+ * @NOTE: about rbtree
+ *   Nodes are embedded in the objects like struct list. The tree doesn't know about keys, caller walks down from
+ *   root to find the place of a new node, links it with rb_link_node(), then calls rb_insert_color() to rebalance:
+ *
+ *     struct rb_node **link = &root->node, *parent = NULL;
+ *     while (*link) {
+ *         parent = *link;
+ *         link = key < rb_entry(parent, struct foo, node)->key ? &parent->left : &parent->right;
+ *     }
+ *     rb_link_node(&foo->node, parent, link);
+ *     rb_insert_color(&foo->node, root);
+ */
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_ROOT (struct rb_root){ NULL }
+
+#define rb_entry(ptr, type, member) \
+    container_of(ptr, type, member)
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+extern void rb_insert_color(struct rb_node *node, struct rb_root *root);
+extern void rb_erase(struct rb_node *node, struct rb_root *root);
+extern struct rb_node* rb_first(struct rb_root *root);
+extern struct rb_node* rb_next(struct rb_node *node);
+
+#endif
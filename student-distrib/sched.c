@@ -0,0 +1,392 @@
+#include "tasks.h"
+#include "timer.h"
+#include "rbtree.h"
+#include "lib.h"
+#include "list.h"
+#include "x86_desc.h"
+
+/*
+ * @reference:
+ *  1. Documentation/scheduler/sched-design-CFS.rst, linux kernel
+ */
+
+/*
+ * @NOTE: about runqueue
+ *   Every runnable task, the running one included, is in a red-black tree ordered by vruntime, the time it has
+ *   run scaled by NICE_0_WEIGHT / weight. The task that has run least(the leftmost one) is picked to run, so
+ *   over time every task gets cpu in proportion to its weight, whatever its time is made up of.
+ *   Within SCHED_LATENCY every runnable task should run once, the running task is preempted when it has used up
+ *   its share of that period, or when it is too far ahead of the leftmost one.
+ *   A waking task gets vruntime no smaller than min_vruntime - SCHED_LATENCY / 2, so a task that has slept long
+ *   runs soon but can't take the cpu for longer than half a period.
+ */
+#define NICE_0_WEIGHT       1024
+#define SCHED_LATENCY       20000   // in us
+#define SCHED_MIN_GRAN      4000    // shortest slice, the period grows when there are too many tasks
+#define SCHED_WAKEUP_GRAN   1000    // a waking task preempts only if it is this much behind
+#define MAX_DELTA_EXEC      1000000 // longer run time is cut, it only happens if the clock goes wrong
+
+/* weight of nice -20 to 19, each level is about 10% of cpu away from the next one */
+static const uint32_t prio_to_weight[MAX_PRIO] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+static struct {
+    uint32_t nr_running;
+    uint32_t total_weight;          // of runnable tasks
+    uint64_t min_vruntime;          // never goes back, new and waking tasks are placed around it
+    struct rb_root timeline;
+    bool need_resched;
+    uint64_t clock_stamp;           // time in ns when run time was last accounted
+    struct task_struct *curr;
+    struct task_struct *idle;       // runs when no task is runnable, it's never on runqueue
+} rq;
+
+#define update_tss(task) tss.esp0 = (unsigned long)(((char*)task)+STACK_SIZE)
+
+#define switch_to(cur,new) \
+do  {   \
+    asm volatile ("pusha;"           \
+         "pushl %%ds;"       \
+         "pushl %%es;"       \
+         "pushl %%fs;"       \
+         "pushl %%gs;"       \
+         "sti;"              \
+         "movl %%esp, %0;" /* save esp */     \
+         "movl %2, %%esp;" /* restore esp */  \
+         "movl $1f, %1;"  /* save eip */    \
+         "jmp %3;"      /* restore eip */   \
+         /* "pushl %3"
+            "jmp __switch_to;"
+            We cannot jmp __switch_to function, because 'push %ebp; movl %esp %ebp' instrutions in function header
+            will corrupt the new task's stack.
+            So we use jmp directly
+          */ \
+         "1: popl %%gs;"    \
+         "popl %%fs;"        \
+         "popl %%es;"        \
+         "popl %%ds;"        \
+         "popa;"            \
+        :"=m"(cur->cpu_state.esp0), "=m"(cur->cpu_state.eip)     \
+        :"m"((new)->cpu_state.esp0), "m"((new)->cpu_state.eip) \
+    );  \
+} while(0)
+
+/* vruntime may wrap, only their difference is meaningful */
+static inline int64_t vruntime_diff(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b);
+}
+
+static void enqueue_task(struct task_struct *task)
+{
+    struct rb_node **link = &rq.timeline.node, *parent = NULL;
+    struct task_struct *entry;
+
+    while (*link) {
+        parent = *link;
+        entry = rb_entry(parent, struct task_struct, run_node);
+        if (vruntime_diff(task->vruntime, entry->vruntime) < 0)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_link_node(&task->run_node, parent, link);
+    rb_insert_color(&task->run_node, &rq.timeline);
+}
+
+static inline void dequeue_task(struct task_struct *task)
+{
+    rb_erase(&task->run_node, &rq.timeline);
+}
+
+static inline struct task_struct* first_task()
+{
+    struct rb_node *node = rb_first(&rq.timeline);
+
+    return node ? rb_entry(node, struct task_struct, run_node) : NULL;
+}
+
+static void update_min_vruntime()
+{
+    struct task_struct *first = first_task();
+
+    if (first && vruntime_diff(first->vruntime, rq.min_vruntime) > 0)
+        rq.min_vruntime = first->vruntime;
+}
+
+/* The period in which every runnable task runs once, and the share of it the task gets */
+static uint32_t sched_slice(struct task_struct *task)
+{
+    uint32_t period = SCHED_LATENCY;
+
+    if (rq.nr_running > SCHED_LATENCY / SCHED_MIN_GRAN)
+        period = rq.nr_running * SCHED_MIN_GRAN;
+    return (uint32_t)div_u64((uint64_t)period * task->weight, rq.total_weight);
+}
+
+/* Run time since last call in us, see ktime_get_ns() */
+static uint32_t clock_delta()
+{
+    uint64_t now = ktime_get_ns();
+    uint32_t delta;
+
+    if (now - rq.clock_stamp >= (uint64_t)MAX_DELTA_EXEC * NSEC_PER_USEC) {
+        rq.clock_stamp = now;
+        return MAX_DELTA_EXEC;
+    }
+    delta = (uint32_t)div_u64(now - rq.clock_stamp, NSEC_PER_USEC);
+    /* the part less than 1us is left to next call */
+    rq.clock_stamp += (uint64_t)delta * NSEC_PER_USEC;
+    return delta;
+}
+
+/* @idle: the task running now, it runs when there is nothing else to run */
+void sched_init(struct task_struct *idle)
+{
+    memset(&rq, 0, sizeof(rq));
+    rq.timeline = RB_ROOT;
+    rq.clock_stamp = ktime_get_ns();
+    rq.idle = idle;
+    rq.curr = idle;
+    idle->static_prio = MAX_PRIO;
+    idle->weight = 0;
+    idle->on_rq = false;
+    idle->state = TASK_RUNNING;
+}
+
+/* Set up scheduling fields of a new task, it gets the default priority and starts from min_vruntime */
+void sched_fork(struct task_struct *task)
+{
+    task->static_prio = DEFAULT_PRIO;
+    task->weight = prio_to_weight[DEFAULT_PRIO];
+    task->vruntime = rq.min_vruntime;
+    task->sum_exec_runtime = 0;
+    task->slice_exec = 0;
+    task->on_rq = false;
+}
+
+/* Put the task on runqueue, preempt the running task if it has run much more than the new one */
+void activate_task(struct task_struct *task)
+{
+    uint64_t vruntime = rq.min_vruntime - SCHED_LATENCY / 2;
+    unsigned long flags;
+
+    cli_and_save(flags);
+    /* sleeping doesn't earn more than half a period */
+    if (vruntime_diff(task->vruntime, vruntime) < 0)
+        task->vruntime = vruntime;
+    task->state = TASK_RUNNABLE;
+    task->on_rq = true;
+    enqueue_task(task);
+    rq.nr_running++;
+    rq.total_weight += task->weight;
+    if (!rq.curr->on_rq || vruntime_diff(rq.curr->vruntime, task->vruntime) > SCHED_WAKEUP_GRAN)
+        rq.need_resched = 1;
+    restore_flags(flags);
+}
+
+/* Take the task off runqueue, caller sets its state and calls schedule() if it's the running task */
+void deactivate_task(struct task_struct *task)
+{
+    unsigned long flags;
+
+    cli_and_save(flags);
+    dequeue_task(task);
+    task->on_rq = false;
+    rq.nr_running--;
+    rq.total_weight -= task->weight;
+    update_min_vruntime();
+    restore_flags(flags);
+}
+
+/*
+ * Choose the task to run, the one with the smallest vruntime, and make it the running task of runqueue
+ * @NOTE: caller must disable interrupts
+ */
+struct task_struct* pick_next_task()
+{
+    struct task_struct *next = first_task();
+
+    rq.need_resched = 0;
+    if (!next)
+        next = rq.idle;
+    if (next != rq.curr) {
+        rq.curr = next;
+        next->slice_exec = 0;
+    }
+    return next;
+}
+
+/*
+ * Charge delta_us of run time to the running task
+ * @return: whether schedule() should be called
+ */
+bool sched_account(struct task_struct *task, uint32_t delta_us)
+{
+    struct task_struct *first;
+    unsigned long flags;
+    uint32_t slice;
+    bool resched;
+
+    cli_and_save(flags);
+    if (!task->on_rq) {
+        /* idle, or a task leaving runqueue */
+        resched = rq.nr_running > 0;
+        restore_flags(flags);
+        return resched;
+    }
+    if (delta_us > MAX_DELTA_EXEC)
+        delta_us = MAX_DELTA_EXEC;
+    task->sum_exec_runtime += delta_us;
+    task->slice_exec += delta_us;
+    /* delta_us * NICE_0_WEIGHT fits in 32 bits */
+    dequeue_task(task);
+    task->vruntime += delta_us * NICE_0_WEIGHT / task->weight;
+    enqueue_task(task);
+    update_min_vruntime();
+
+    slice = sched_slice(task);
+    first = first_task();
+    if (task->slice_exec >= slice) {
+        /* start a new slice if it is still the one to run */
+        if (first == task)
+            task->slice_exec = 0;
+        else
+            rq.need_resched = 1;
+    } else if (first != task && task->slice_exec >= SCHED_MIN_GRAN &&
+               vruntime_diff(task->vruntime, first->vruntime) > (int64_t)slice) {
+        rq.need_resched = 1;
+    }
+    resched = rq.need_resched;
+    restore_flags(flags);
+    return resched;
+}
+
+/*
+ * Account one timer tick to the running task
+ * @return: whether schedule() should be called
+ */
+bool sched_tick(struct task_struct *task)
+{
+    return sched_account(task, clock_delta());
+}
+
+/*
+ * Put a sleeping task back on runqueue
+ * @return: false if the task is runnable already
+ */
+bool wake_up_process(struct task_struct *task)
+{
+    unsigned long flags;
+    bool ret = false;
+
+    cli_and_save(flags);
+    if (task != rq.idle && !task->on_rq) {
+        activate_task(task);
+        ret = true;
+    }
+    restore_flags(flags);
+    return ret;
+}
+
+bool is_idle_task(struct task_struct *task)
+{
+    return task == rq.idle;
+}
+
+/* Whether the running task should call schedule() */
+bool need_resched()
+{
+    return rq.need_resched;
+}
+
+/* @return: the new nice value, nice is clamped to [MIN_NICE, MAX_NICE] */
+int set_user_nice(struct task_struct *task, int nice)
+{
+    unsigned long flags;
+
+    if (nice < MIN_NICE)
+        nice = MIN_NICE;
+    if (nice > MAX_NICE)
+        nice = MAX_NICE;
+
+    cli_and_save(flags);
+    if (task->on_rq)
+        rq.total_weight -= task->weight;
+    task->static_prio = NICE_TO_PRIO(nice);
+    task->weight = prio_to_weight[task->static_prio];
+    if (task->on_rq) {
+        rq.total_weight += task->weight;
+        /* the running task may not deserve its slice any more */
+        rq.need_resched = 1;
+    }
+    restore_flags(flags);
+    return nice;
+}
+
+extern char init_finish;
+
+void schedule()
+{
+    struct task_struct *cur = current();
+    struct task_struct *next = NULL;
+    /* nothing to switch to yet, drop the request or cpu_idle() would keep calling back */
+    if (!init_finish) {
+        rq.need_resched = 0;
+        return;
+    }
+
+    cli();
+    /* the part of a tick since last timer interrupt */
+    sched_account(cur, clock_delta());
+    next = pick_next_task();
+    if (next == cur) {
+        sti();
+        return;
+    }
+
+    if (cur->state == TASK_RUNNING)
+        cur->state = TASK_RUNNABLE;
+    next->state = TASK_RUNNING;
+
+    update_tss(next);
+    /* kernel threads have no user space, they borrow the address space of previous task */
+    if (next->mm)
+        switch_mm(cur->mm, next->mm);
+    switch_to(cur, next);
+}
+
+/*
+ * Loop of the idle task. With nothing to run, free pages are zeroed in background so that alloc_pages_zeroed()
+ * rarely clears memory itself, then cpu sleeps in hlt with the tick stopped until an interrupt makes some task
+ * runnable. The tick is stopped again after every wakeup, since the interrupt may have added a timer that
+ * expires before the programmed wakeup.
+ */
+void cpu_idle()
+{
+    while (1) {
+        while (!need_resched()) {
+            if (zero_free_pages())
+                continue;
+            cli();
+            if (need_resched()) {
+                sti();
+            } else {
+                tick_nohz_idle_enter();
+                safe_halt();
+            }
+        }
+        cli();
+        tick_nohz_idle_exit();
+        sti();
+        schedule();
+    }
+}
@@ -0,0 +1,329 @@
+#include "slab.h"
+#include "mm.h"
+#include "lib.h"
+#include "list.h"
+
+/*
+ * @reference:
+ *  1. The Slab Allocator: An Object-Caching Kernel Memory Allocator, Jeff Bonwick
+ */
+
+/*
+ * @NOTE: about slab
+ *   A slab is a buddy block of (1 << order) pages, which is cut into objects of the same size. Its layout is
+ *
+ *     | struct slab | bufctl[nr_objs] | color | obj0 | obj1 | ... | objn | unused |
+ *
+ *   bufctl[i] is the index of the next free object after object i, so allocating and freeing are O(1) and
+ *   objects are never written by the allocator, what constructor did is kept until the object is freed.
+ *   Every page of a slab has PG_SLAB set and order of slab in struct page, so the slab of an object is found
+ *   by aligning its address down to the slab size.
+ *   Slabs of a cache start their objects at different offsets(color), so that objects in different slabs don't
+ *   always fall into the same cpu cache lines.
+ */
+#define BUFCTL_END 0xffff
+#define MAX_SLAB_ORDER 3
+
+/*
+ * @NOTE: about empty slabs
+ *   A cache keeps some empty slabs, so that a burst of alloc/free around a slab boundary doesn't go to buddy system
+ *   every time. The limit grows with slabs in use and falls back to 1 as the cache becomes idle, empty slabs above it
+ *   are given back at once. Under memory pressure no empty slab is kept, and kmem_cache_reap() is registered as
+ *   a shrinker to give back all of them.
+ */
+#define SLAB_FREE_RATIO 4
+
+struct slab {
+    struct list list;       // in slabs_full, slabs_partial or slabs_free of cache
+    struct kmem_cache *cache;
+    void *s_mem;            // first object
+    uint32_t inuse;
+    uint16_t free;          // index of first free object
+    uint16_t bufctl[0];
+};
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+/* initialized statically, so that kmem_cache_reap() works before kmem_cache_init() */
+static struct list cache_chain = { &cache_chain, &cache_chain };
+
+/* caches are objects too, the first cache is set up by hand */
+static struct kmem_cache cache_cache;
+
+static inline uint32_t slab_mgmt_size(uint32_t nr_objs, uint32_t align)
+{
+    return ALIGN(sizeof(struct slab) + nr_objs * sizeof(uint16_t), align);
+}
+
+/* Find the smallest order whose wasted space is no more than 1/8 of the slab */
+static void cache_estimate(struct kmem_cache *cache)
+{
+    uint32_t slab_size, nr, left;
+
+    for (cache->order = 0; ; ++cache->order) {
+        slab_size = PAGE_SIZE << cache->order;
+        nr = (slab_size - sizeof(struct slab)) / (cache->size + sizeof(uint16_t));
+        while (nr && slab_mgmt_size(nr, cache->align) + nr * cache->size > slab_size)
+            --nr;
+        if (nr >= BUFCTL_END)
+            nr = BUFCTL_END - 1;
+        left = slab_size - slab_mgmt_size(nr, cache->align) - nr * cache->size;
+        if (nr && (left * 8 <= slab_size || cache->order == MAX_SLAB_ORDER))
+            break;
+    }
+    cache->nr_objs = nr;
+    cache->color_off = cache->align > CACHE_LINE_SIZE ? cache->align : CACHE_LINE_SIZE;
+    cache->colors = left / cache->color_off + 1;
+}
+
+static void init_cache(struct kmem_cache *cache, const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    cache->name = name;
+    cache->align = align;
+    cache->size = ALIGN(size, align);
+    cache->ctor = ctor;
+    INIT_LIST(&cache->slabs_full);
+    INIT_LIST(&cache->slabs_partial);
+    INIT_LIST(&cache->slabs_free);
+    cache_estimate(cache);
+    list_add_tail(&cache_chain, &cache->list);
+}
+
+static uint32_t slab_shrink(uint32_t nr_pages)
+{
+    return kmem_cache_reap();
+}
+
+static struct shrinker slab_shrinker = { "slab", slab_shrink };
+
+void kmem_cache_init()
+{
+    INIT_LIST(&cache_chain);
+    init_cache(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, NULL);
+    register_shrinker(&slab_shrinker);
+}
+
+/*
+ * @align: objects are aligned to it, must be power of 2, 0 means word aligned.
+ *         Use CACHE_LINE_SIZE for objects that are written by different cpus.
+ * @ctor: called once for every object when a new slab is created, freed objects must be in constructed state
+ */
+struct kmem_cache* kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    struct kmem_cache *cache;
+    unsigned long flags;
+
+    panic_on(!size || size > (PAGE_SIZE << MAX_SLAB_ORDER) / 2, "invalid object size %u\n", size);
+    panic_on(align & (align - 1), "align %u is not power of 2\n", align);
+    cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+
+    cli_and_save(flags);
+    init_cache(cache, name, size, align, ctor);
+    restore_flags(flags);
+    return cache;
+}
+
+/* @NOTE: caller must disable interrupts */
+static struct slab* cache_grow(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    struct page *page;
+    uint32_t i;
+    char *obj;
+
+    slab = alloc_pages(cache->order);
+    if (!slab)
+        return NULL;
+    for (i = 0; i < (1 << cache->order); ++i) {
+        page = virt_to_page((char*)slab + i * PAGE_SIZE);
+        page_set_flag(page, PG_SLAB);
+        page->order = cache->order;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->s_mem = (char*)slab + slab_mgmt_size(cache->nr_objs, cache->align) + cache->color_next * cache->color_off;
+    if (++cache->color_next >= cache->colors)
+        cache->color_next = 0;
+
+    obj = slab->s_mem;
+    for (i = 0; i < cache->nr_objs; ++i, obj += cache->size) {
+        slab->bufctl[i] = i + 1;
+        if (cache->ctor)
+            cache->ctor(obj);
+    }
+    slab->bufctl[cache->nr_objs - 1] = BUFCTL_END;
+    slab->free = 0;
+
+    list_add_head(&cache->slabs_free, &slab->list);
+    cache->nr_slabs++;
+    cache->nr_free_slabs++;
+    return slab;
+}
+
+/* Give an empty slab back to buddy system. @NOTE: caller must disable interrupts */
+static void slab_destroy(struct kmem_cache *cache, struct slab *slab)
+{
+    uint32_t i;
+
+    list_del(&slab->list);
+    cache->nr_slabs--;
+    cache->nr_free_slabs--;
+    for (i = 0; i < (1 << cache->order); ++i)
+        page_clear_flag(virt_to_page((char*)slab + i * PAGE_SIZE), PG_SLAB);
+    free_pages(slab, cache->order);
+}
+
+void* kmem_cache_alloc(struct kmem_cache *cache)
+{
+    struct slab *slab;
+    unsigned long flags;
+    void *obj;
+
+    cli_and_save(flags);
+    if (list_empty(&cache->slabs_partial)) {
+        if (list_empty(&cache->slabs_free) && !cache_grow(cache)) {
+            restore_flags(flags);
+            return NULL;
+        }
+        slab = list_entry(cache->slabs_free.next, struct slab, list);
+        list_del(&slab->list);
+        list_add_head(&cache->slabs_partial, &slab->list);
+        cache->nr_free_slabs--;
+    }
+    slab = list_entry(cache->slabs_partial.next, struct slab, list);
+
+    obj = (char*)slab->s_mem + slab->free * cache->size;
+    slab->free = slab->bufctl[slab->free];
+    slab->inuse++;
+    cache->nr_active++;
+    if (slab->inuse == cache->nr_objs) {
+        list_del(&slab->list);
+        list_add_head(&cache->slabs_full, &slab->list);
+    }
+    restore_flags(flags);
+
+    return obj;
+}
+
+static inline struct slab* virt_to_slab(const void *obj)
+{
+    struct page *page = virt_to_page(obj);
+
+    if (!page_test_flag(page, PG_SLAB))
+        return NULL;
+    return (struct slab*)((unsigned long)obj & ~((PAGE_SIZE << page->order) - 1));
+}
+
+/* @return: the cache which obj was allocated from, or NULL if obj is not in a slab */
+struct kmem_cache* virt_to_cache(const void *obj)
+{
+    struct slab *slab = virt_to_slab(obj);
+
+    return slab ? slab->cache : NULL;
+}
+
+static inline uint32_t free_slabs_limit(struct kmem_cache *cache)
+{
+    if (unlikely(mm_under_pressure()))
+        return 0;
+    return (cache->nr_slabs - cache->nr_free_slabs) / SLAB_FREE_RATIO + 1;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    struct slab *slab = virt_to_slab(obj);
+    unsigned long flags;
+    uint32_t offset, idx;
+
+    panic_on(!slab || slab->cache != cache, "free object 0x%x to wrong cache %s\n", obj, cache->name);
+    offset = (char*)obj - (char*)slab->s_mem;
+    idx = offset / cache->size;
+    panic_on(offset % cache->size || idx >= cache->nr_objs, "invalid object 0x%x of cache %s\n", obj, cache->name);
+
+    cli_and_save(flags);
+    slab->bufctl[idx] = slab->free;
+    slab->free = idx;
+    cache->nr_active--;
+    if (slab->inuse-- == cache->nr_objs) {
+        list_del(&slab->list);
+        list_add_head(&cache->slabs_partial, &slab->list);
+    }
+    if (!slab->inuse) {
+        list_del(&slab->list);
+        list_add_head(&cache->slabs_free, &slab->list);
+        cache->nr_free_slabs++;
+        /* the coldest empty slabs are at the tail */
+        while (cache->nr_free_slabs > free_slabs_limit(cache))
+            slab_destroy(cache, list_entry(cache->slabs_free.prev, struct slab, list));
+    }
+    restore_flags(flags);
+}
+
+/*
+ * Give all empty slabs of cache back to buddy system
+ * @return: number of pages freed
+ */
+uint32_t kmem_cache_shrink(struct kmem_cache *cache)
+{
+    unsigned long flags;
+    uint32_t nr = 0;
+
+    cli_and_save(flags);
+    while (!list_empty(&cache->slabs_free)) {
+        slab_destroy(cache, list_entry(cache->slabs_free.next, struct slab, list));
+        nr += 1 << cache->order;
+    }
+    restore_flags(flags);
+    return nr;
+}
+
+/*
+ * Shrink every cache, called when buddy system is short of free pages
+ * @return: number of pages freed
+ */
+uint32_t kmem_cache_reap()
+{
+    struct list *cur;
+    unsigned long flags;
+    uint32_t nr = 0;
+
+    cli_and_save(flags);
+    list_for_each(cur, &cache_chain)
+        nr += kmem_cache_shrink(list_entry(cur, struct kmem_cache, list));
+    restore_flags(flags);
+    return nr;
+}
+
+/* All objects must have been freed */
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+    unsigned long flags;
+
+    cli_and_save(flags);
+    panic_on(cache->nr_active, "destroy cache %s with %u active objects\n", cache->name, cache->nr_active);
+    while (!list_empty(&cache->slabs_free))
+        slab_destroy(cache, list_entry(cache->slabs_free.next, struct slab, list));
+    list_del(&cache->list);
+    restore_flags(flags);
+
+    kmem_cache_free(&cache_cache, cache);
+}
+
+void slab_show_statistics()
+{
+    struct kmem_cache *cache;
+    struct list *cur;
+
+    list_for_each(cur, &cache_chain) {
+        cache = list_entry(cur, struct kmem_cache, list);
+        printf("%s: size %u, %u objs/slab of order %u, %u colors, %u slabs(%u free), %u active objs\n",
+               cache->name, cache->size, cache->nr_objs, cache->order, cache->colors,
+               cache->nr_slabs, cache->nr_free_slabs, cache->nr_active);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "types.h"
+#include "list.h"
+
+#define CACHE_LINE_SIZE 64
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+struct kmem_cache {
+    const char *name;
+    uint32_t size;          // object size, aligned to align
+    uint32_t align;
+    uint32_t order;         // every slab has (1 << order) pages
+    uint32_t nr_objs;       // objects per slab
+    uint32_t colors;        // number of different offsets of the first object in slab
+    uint32_t color_off;     // distance between two colors, at least one cache line
+    uint32_t color_next;
+    kmem_ctor_t ctor;
+
+    struct list slabs_full;
+    struct list slabs_partial;
+    struct list slabs_free;
+    uint32_t nr_slabs;
+    uint32_t nr_free_slabs;
+    uint32_t nr_active;     // objects in use
+
+    struct list list;       // in cache_chain
+};
+
+extern void kmem_cache_init();
+extern struct kmem_cache* kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+extern void kmem_cache_destroy(struct kmem_cache *cache);
+extern void* kmem_cache_alloc(struct kmem_cache *cache);
+extern void kmem_cache_free(struct kmem_cache *cache, void *obj);
+extern uint32_t kmem_cache_shrink(struct kmem_cache *cache);
+extern uint32_t kmem_cache_reap();
+extern struct kmem_cache* virt_to_cache(const void *obj);
+extern void slab_show_statistics();
+
+#endif
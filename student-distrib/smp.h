@@ -0,0 +1,15 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+/*
+ * We only run on the boot processor now, per-cpu data is an array indexed by
+ * smp_processor_id(), so that it's easy to support more cpus in future.
+ */
+#define NR_CPUS 1
+
+static inline int smp_processor_id()
+{
+    return 0;
+}
+
+#endif
@@ -1,10 +1,119 @@
+#include "syscall.h"
 #include "i8259.h"
 #include "lib.h"
+#include "mm.h"
+#include "tasks.h"
+#include "timer.h"
+#include "errno.h"
 
-/* system call: SYSCALL_INTR */
-unsigned long syscall_handler(unsigned long c, unsigned long esp)
+/* Registers saved by syscall_interrupt_entry */
+struct syscall_regs {
+    uint32_t gs;
+    uint32_t fs;
+    uint32_t es;
+    uint32_t ds;
+    /* pushed by pusha */
+    uint32_t edi;
+    uint32_t esi;
+    uint32_t ebp;
+    uint32_t esp_dummy;
+    uint32_t ebx;
+    uint32_t edx;
+    uint32_t ecx;
+    uint32_t eax;
+} __attribute__ ((packed));
+
+typedef int32_t (*syscall_t)(uint32_t arg1, uint32_t arg2, uint32_t arg3);
+
+static int32_t sys_putc(uint32_t c, uint32_t unused1, uint32_t unused2)
 {
     printf("%c", c);
+    return 0;
+}
+
+static int32_t sys_memstat(uint32_t which, uint32_t buf, uint32_t size)
+{
+    struct buddy_stats buddy;
+    struct kmalloc_stats kmalloc;
+    const void *stats;
+    uint32_t len;
+
+    switch (which) {
+    case MEMSTAT_BUDDY:
+        mm_get_stats(&buddy);
+        stats = &buddy;
+        len = sizeof(buddy);
+        break;
+    case MEMSTAT_KMALLOC:
+        kmalloc_get_stats(&kmalloc);
+        stats = &kmalloc;
+        len = sizeof(kmalloc);
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (size < len)
+        return -EINVAL;
+    if (copy_to_user((void*)buf, stats, len))
+        return -EFAULT;
+    return len;
+}
+
+static int32_t sys_nice(uint32_t inc, uint32_t unused1, uint32_t unused2)
+{
+    struct task_struct *task = current();
+
+    set_user_nice(task, task_nice(task) + (int32_t)inc);
+    return 0;
+}
+
+static int32_t sys_gettime(uint32_t tp, uint32_t unused1, uint32_t unused2)
+{
+    struct timespec ts;
+
+    ns_to_timespec(ktime_get_ns(), &ts);
+    if (copy_to_user((void*)tp, &ts, sizeof(ts)))
+        return -EFAULT;
+    return 0;
+}
+
+#define MAX_SLEEP_SEC (0x7fffffff / HZ - 1)    // timeout in jiffies must fit in int32_t
+
+static int32_t sys_nanosleep(uint32_t req, uint32_t unused1, uint32_t unused2)
+{
+    struct timespec ts;
+    uint32_t timeout;
+
+    if (copy_from_user(&ts, (const void*)req, sizeof(ts)))
+        return -EFAULT;
+    if (ts.tv_nsec >= NSEC_PER_SEC || ts.tv_sec >= MAX_SLEEP_SEC)
+        return -EINVAL;
+    /* round up to jiffies, and the current jiffy is partly gone */
+    timeout = ts.tv_sec * HZ + (ts.tv_nsec + TICK_NS - 1) / TICK_NS + 1;
+    while (timeout) {
+        current()->state = TASK_INTERRUPTIBLE;
+        timeout = schedule_timeout(timeout);
+    }
+    return 0;
+}
+
+static const syscall_t syscall_table[NR_SYSCALLS] = {
+    [SYS_PUTC] = sys_putc,
+    [SYS_MEMSTAT] = sys_memstat,
+    [SYS_NICE] = sys_nice,
+    [SYS_GETTIME] = sys_gettime,
+    [SYS_NANOSLEEP] = sys_nanosleep,
+};
+
+/* system call: SYSCALL_INTR */
+unsigned long syscall_handler(unsigned long nr, unsigned long esp)
+{
+    struct syscall_regs *regs = (struct syscall_regs*)esp;
+
+    if (nr < NR_SYSCALLS && syscall_table[nr])
+        regs->eax = syscall_table[nr](regs->ebx, regs->ecx, regs->edx);
+    else
+        regs->eax = -ENOSYS;
     send_eoi(0x80);
 
     return esp;
@@ -0,0 +1,21 @@
+#ifndef _SYSCALL_H
+#define _SYSCALL_H
+
+/*
+ * @NOTE: about system call
+ *   User program puts the number in eax and at most three arguments in ebx, ecx and edx, then executes
+ *   int $SYSCALL_INTR. Return value is put in eax, negative value is -errno.
+ *   This file is also included by assembly, so only macros are allowed here.
+ */
+#define SYS_PUTC    0   // int putc(char c)
+#define SYS_MEMSTAT 1   // int memstat(int which, void *buf, uint32_t size), return size of the stats
+#define SYS_NICE    2   // int nice(int inc), return 0, nice value is clamped to [-20, 19]
+#define SYS_GETTIME 3   // int gettime(struct timespec *tp), monotonic time since boot, see timer.h
+#define SYS_NANOSLEEP 4 // int nanosleep(const struct timespec *req), sleep at least req, in jiffies
+#define NR_SYSCALLS 5
+
+/* which of SYS_MEMSTAT */
+#define MEMSTAT_BUDDY   0   // struct buddy_stats, see mm.h
+#define MEMSTAT_KMALLOC 1   // struct kmalloc_stats, see liballoc.h
+
+#endif
@@ -4,6 +4,7 @@
 #include "list.h"
 #include "x86_desc.h"
 #include "mm.h"
+#include "errno.h"
 
 extern void user0();
 extern void *user_stk0;
@@ -13,8 +14,6 @@ extern void user2();
 extern void *user_stk2;
 extern void first_return_to_user();
 
-struct list running_tasks;
-struct list runnable_tasks;  // waiting for time slice
 struct list waiting_tasks;   // waiing for io or lock or something
 
 static unsigned long next_pid = 0;
@@ -35,10 +34,27 @@ void __init_task(struct task_struct *task, unsigned long eip, unsigned long user
     task->cpu_state.esp0 = kernel_stack;
     task->state = TASK_RUNNABLE;
     task->parent = NULL;
-    task->mm = alloc_page();
+    sched_fork(task);
+    task->mm = mm_alloc();
     panic_on(task->mm == NULL, "allocate mm failed\n");
 }
 
+/*
+ * User code lives in kernel image, it's copied to USER_BASE when it's executed the first time, and user stack
+ * is allocated page by page when it grows, so a new task pays only for the pages it touches.
+ * @eip: kernel address of user code, changed to the user address
+ */
+static void setup_user_mm(struct mm *mm, unsigned long *eip)
+{
+    unsigned long text = *eip & ~PAGE_MASK;
+
+    /* code may cross page boundary, map the next page too */
+    panic_on(add_vma(mm, USER_BASE, USER_BASE + 2 * PAGE_SIZE, VM_READ | VM_EXEC, text), "add text vma failed\n");
+    panic_on(add_vma(mm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP, VM_READ | VM_WRITE, 0),
+             "add stack vma failed\n");
+    *eip = USER_BASE + (*eip & PAGE_MASK);
+}
+
 void init_task(struct task_struct *task, unsigned long eip, unsigned long user_stack, unsigned long kernel_stack)
 {
     unsigned long *kernel_stk = (unsigned long*)kernel_stack;
@@ -52,11 +68,13 @@ void init_task(struct task_struct *task, unsigned long eip, unsigned long user_s
      * 我们通过switch_to切换task时，通过jmp指令直接跳转到 first_return_to_user处，然后拿出预先放好的esp和eip，进行iret到用户态
      */
     __init_task(task, (unsigned long)first_return_to_user, user_stack, (unsigned long)kernel_stack);
+    setup_user_mm(task->mm, &eip);
+    user_stack = USER_STACK_TOP;
     kernel_stk -= 2;
     /* push eip/esp that iret needed, see first_return_to_user */
     kernel_stk[0] = eip;
     kernel_stk[1] = user_stack;
-    list_add_tail(&runnable_tasks, &task->task_list);
+    activate_task(task);
 }
 
 static struct task_struct* alloc_task()
@@ -102,10 +120,11 @@ int test_tasks()
     tss.cs = KERNEL_CS;
     ltr(KERNEL_TSS);
     __init_task(task0, (unsigned long)user0, (unsigned long)&user_stk0, (unsigned long)(((char*)task0) + STACK_SIZE));
+    /* task0 runs first, it's queued before the others so that it's the head of its list */
+    activate_task(task0);
     init_task(task1, (unsigned long)user1, (unsigned long)&user_stk1, (unsigned long)(((char*)task1) + STACK_SIZE));
     init_task(task2, (unsigned long)user2, (unsigned long)&user_stk2, (unsigned long)(((char*)task2) + STACK_SIZE));
     tss.cr3 = (unsigned long)init_pgtbl_dir;
-    list_add_tail(&running_tasks, &task0->task_list);
     init_finish = 1;
     asm volatile ("pushfl;"
                   "andl $0xffffbfff, %esp;" // clear busy flag
@@ -134,41 +153,25 @@ static pid_t get_pid()
     return ret;
 }
 
+/* The boot code becomes the first task, its task_struct is at the low end of the boot stack, see current() */
 void init_tasks()
 {
-    struct task_struct *task0 = alloc_task();
-    INIT_LIST(&runnable_tasks);
     INIT_LIST(&waiting_tasks);
-    INIT_LIST(&running_tasks);
 
-    current()->mm->pgdir = init_pgtbl_dir;
-    current()->state = TASK_RUNNING;
+    current()->mm = &init_mm;
     current()->parent = NULL;
     current()->pid = get_pid();
-    list_add_tail(&running_tasks, &current()->task_list);
+    /* the boot task becomes the idle task */
+    sched_init(current());
     // current()->cpu_state.esp0 = alloc_page();
 }
 
-static int do_syscall_fork(struct task_struct *old, struct task_struct *new)
-{
-    int ret = 0;
-    if (!old || !new) {
-        panic("invalid args:%p %p\n", old, new);
-    }
-
-    new->pid = get_pid();
-    new->parent = old;
-
-    return ret;
-}
-
-void new_kthread(unsigned long addr)
+/* @return: 0 on success, -ENOMEM if there is no memory for the task even after reclaiming */
+int new_kthread(unsigned long addr)
 {
     struct task_struct *task = alloc_task();
-    if (!task) {
-        panic("failed to malloc memory\n");
-        return;
-    }
+    if (!task)
+        return -ENOMEM;
 
     task->cpu_state.ds = KERNEL_DS;
     task->cpu_state.fs = KERNEL_DS;
@@ -187,4 +190,6 @@ void new_kthread(unsigned long addr)
     task->cpu_state.esi = 0;
     task->cpu_state.edi = 0;
     task->cpu_state.ebp = 0;
+    task->mm = NULL;
+    return 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "mm.h"
 #include "types.h"
 #include "x86_desc.h"
+#include "rbtree.h"
 
 #define STACK_SIZE (2*PAGE_SIZE)
 
@@ -42,6 +43,18 @@ typedef enum task_state {
 
 typedef unsigned long pid_t;
 
+/*
+ * @NOTE: about priority
+ *   Like unix, nice is in [-20, 19], smaller nice means higher priority. static_prio is nice mapped to
+ *   [0, MAX_PRIO), it decides the weight of the task, which is the share of cpu the task gets, see sched.c.
+ */
+#define MAX_PRIO    40
+#define MIN_NICE    -20
+#define MAX_NICE    19
+#define NICE_TO_PRIO(nice)  ((nice) - MIN_NICE)
+#define PRIO_TO_NICE(prio)  ((prio) + MIN_NICE)
+#define DEFAULT_PRIO        NICE_TO_PRIO(0)
+
 struct task_struct {
     union {
         char stack[STACK_SIZE];
@@ -53,6 +66,14 @@ struct task_struct {
             char comm[16];
             struct mm* mm;
 
+            int static_prio;
+            uint32_t weight;            // cpu share relative to other runnable tasks, 1024 for nice 0
+            uint64_t vruntime;          // run time in us, scaled by NICE_0_WEIGHT / weight
+            uint64_t sum_exec_runtime;  // run time in us since the task was created
+            uint32_t slice_exec;        // run time in us since the task was picked to run
+            bool on_rq;
+            struct rb_node run_node;    // in runqueue, ordered by vruntime
+
             struct regs cpu_state;
         };
     };
@@ -64,11 +85,31 @@ static inline struct task_struct* current()
     return (struct task_struct*)(((unsigned long)&i) & ~(STACK_SIZE-1));
 }
 
+extern int copy_mm(struct task_struct *old, struct task_struct *new);
+extern void exit_mm(struct task_struct *task);
+
 extern int test_tasks();
 extern void init_tasks();
 
-extern struct list running_tasks;
-extern struct list runnable_tasks;  // waiting for time slice
 extern struct list waiting_tasks;   // waiing for io or lock or something
 
+extern void sched_init(struct task_struct *idle);
+extern void sched_fork(struct task_struct *task);
+extern void activate_task(struct task_struct *task);
+extern void deactivate_task(struct task_struct *task);
+extern bool wake_up_process(struct task_struct *task);
+extern bool is_idle_task(struct task_struct *task);
+extern struct task_struct* pick_next_task();
+extern bool sched_tick(struct task_struct *task);
+extern bool sched_account(struct task_struct *task, uint32_t delta_us);
+extern int set_user_nice(struct task_struct *task, int nice);
+extern void schedule();
+extern bool need_resched();
+extern void cpu_idle();
+
+static inline int task_nice(struct task_struct *task)
+{
+    return PRIO_TO_NICE(task->static_prio);
+}
+
 #endif
@@ -59,7 +59,28 @@ bool launch_tests() {
 	// launch your tests here
     if (test_list() == false)
         return false;
+    if (test_rbtree() == false)
+        return false;
+    if (test_slab() == false)
+        return false;
+    if (test_kmalloc() == false)
+        return false;
     test_paging();
     test_alloc_pages();
+    test_alloc_pages_zeroed();
+    test_tlb_global_pages();
+    test_demand_paging();
+    test_cow_fork();
+    test_mm_stats();
+    test_alloc_contig();
+    test_alloc_zones();
+    test_mm_pressure();
+    test_timekeeping();
+    test_timer_wheel();
+    test_sched();
+    test_sched_fairness();
+#ifdef MM_DEBUG
+    test_mm_debug();
+#endif
     return true;
 }
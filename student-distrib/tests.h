@@ -2,7 +2,11 @@
 #define _TESTS_H
 
 #include "tests/test_list.h"
+#include "tests/test_rbtree.h"
 #include "tests/test_mm.h"
+#include "tests/test_slab.h"
+#include "tests/test_sched.h"
+#include "tests/test_time.h"
 
 // test launcher
 bool launch_tests();
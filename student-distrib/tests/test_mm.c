@@ -1,6 +1,9 @@
 #include "../types.h"
 #include "../mm.h"
 #include "../lib.h"
+#include "../tasks.h"
+#include "../errno.h"
+#include "../mm_debug.h"
 
 extern pgd_t* init_pgtbl_dir;
 
@@ -20,12 +23,17 @@ void test_paging()
     pte_offset = get_bits(linear_addr, 0, 11);
 
     pde = (uint32_t)*(init_pgtbl_dir + pgd_offset);
-    pde &= ~(PAGE_MASK);
-    pte = *(uint32_t*)(pde + pde_offset*4);
-    pte &= ~(PAGE_MASK);
-    // pte = ((uint32_t*)pde)[pde_offset];
-    phy_addr = pte & ~(PAGE_MASK);
-    phy_addr |= pte_offset;
+    if (CHECK_FLAG(pde, PS_BIT)) {
+        /* 4M page, the low 22 bits of linear address are the offset in page */
+        phy_addr = (pde & ~LARGE_PAGE_MASK) | (linear_addr & LARGE_PAGE_MASK);
+    } else {
+        pde &= ~(PAGE_MASK);
+        pte = *(uint32_t*)(pde + pde_offset*4);
+        pte &= ~(PAGE_MASK);
+        // pte = ((uint32_t*)pde)[pde_offset];
+        phy_addr = pte & ~(PAGE_MASK);
+        phy_addr |= pte_offset;
+    }
 
     if (phy_addr != linear_addr) {
         panic("BUG: paging error\n");
@@ -38,6 +46,8 @@ void test_alloc_pages()
     uint32_t stats1[MAX_ORDER] = {0};
     uint32_t stats2[MAX_ORDER] = {0};
 
+    /* pages cached in pcp are not in buddy free lists, give them back so that statistics are comparable */
+    drain_local_pages();
     mm_show_statistics(stats1);
     p0 = alloc_page();
     clear();
@@ -64,7 +74,335 @@ void test_alloc_pages()
 
     clear();
     free_pages(p2, 2);
+    drain_local_pages();
     mm_show_statistics(stats2);
 
     panic_on(memcmp(stats1, stats2, sizeof(stats1)), "buddy system error!\n");
-}
\ No newline at end of file
+}
+void test_alloc_pages_zeroed()
+{
+    uint32_t *p;
+    int i;
+
+    p = alloc_pages_zeroed(2);
+    panic_on(p == NULL, "alloc zeroed pages failed\n");
+    for (i = 0; i < (PAGE_SIZE << 2) / sizeof(*p); ++i) {
+        panic_on(p[i], "page 0x%x is not zeroed\n", p);
+        p[i] = 0xdeadbeef;
+    }
+    free_pages(p, 2);
+
+    /* the dirty block was just freed, it must be cleared before handed out again */
+    p = alloc_pages_zeroed(2);
+    panic_on(p == NULL, "alloc zeroed pages failed\n");
+    for (i = 0; i < (PAGE_SIZE << 2) / sizeof(*p); ++i)
+        panic_on(p[i], "page 0x%x is not zeroed\n", p);
+    free_pages(p, 2);
+}
+
+#define TLB_BENCH_PAGES 64
+#define TLB_BENCH_LOOPS 1000
+
+/*
+ * Reload CR3 like a context switch to another page directory does, then count cycles of touching kernel pages.
+ * @return: average cycles of one round
+ */
+static uint32_t tlb_bench_round(volatile uint32_t *pages[TLB_BENCH_PAGES])
+{
+    uint32_t cycles = 0;
+    uint32_t start;
+    int i, j;
+
+    for (i = 0; i < TLB_BENCH_LOOPS; ++i) {
+        load_cr3(init_pgtbl_dir);
+        start = (uint32_t)rdtsc();
+        for (j = 0; j < TLB_BENCH_PAGES; ++j)
+            (void)*pages[j];
+        cycles += (uint32_t)rdtsc() - start;
+    }
+    return cycles / TLB_BENCH_LOOPS;
+}
+
+/* Compare cycles spent on kernel TLB misses after CR3 reloading, with and without global kernel mappings */
+void test_tlb_global_pages()
+{
+    volatile uint32_t *pages[TLB_BENCH_PAGES];
+    uint32_t cr4 = read_cr4();
+    uint32_t without_pge, with_pge;
+    int i;
+
+    if (!pge_supported()) {
+        printf("PGE is not supported, skip tlb benchmark\n");
+        return;
+    }
+
+    /* memory from 1M to 4M is mapped by 4K pages, so every page needs its own TLB entry. Only read them */
+    for (i = 0; i < TLB_BENCH_PAGES; ++i)
+        pages[i] = (uint32_t*)(0x100000 + i * PAGE_SIZE);
+
+    /* clearing CR4.PGE also flushes global TLB entries */
+    write_cr4(cr4 & ~X86_CR4_PGE);
+    without_pge = tlb_bench_round(pages);
+    write_cr4(cr4 | X86_CR4_PGE);
+    with_pge = tlb_bench_round(pages);
+    write_cr4(cr4);
+
+    printf("touch %d kernel pages after CR3 reload: %u cycles without PGE, %u cycles with PGE\n",
+           TLB_BENCH_PAGES, without_pge, with_pge);
+}
+
+/* Pages of a vm_area are allocated when they are touched the first time */
+void test_demand_paging()
+{
+    struct mm *old = current()->mm;
+    struct mm *mm = mm_alloc();
+    volatile uint32_t *p = (uint32_t*)USER_BASE;
+
+    panic_on(mm == NULL, "alloc mm failed\n");
+    panic_on(add_vma(mm, USER_BASE, USER_BASE + 16 * PAGE_SIZE, VM_READ | VM_WRITE, 0), "add vma failed\n");
+    panic_on(add_vma(mm, USER_BASE + PAGE_SIZE, USER_BASE + 2 * PAGE_SIZE, VM_READ, 0) != -EEXIST,
+             "overlapped vma is added\n");
+
+    current()->mm = mm;
+    switch_mm(old, mm);
+    panic_on(mm->rss != 0, "pages are mapped before touched\n");
+    p[0] = 1;
+    p[3 * PAGE_SIZE / sizeof(*p) + 1] = 2;
+    panic_on(p[1] != 0, "new page is not zeroed\n");
+    panic_on(mm->rss != 2, "%u pages mapped, expect 2\n", mm->rss);
+    switch_mm(mm, old);
+    current()->mm = old;
+
+    mm_release(mm);
+}
+
+#define FORK_BENCH_PAGES 64
+#define FORK_BENCH_LOOPS 100
+
+/* Pages are shared after fork, and copied when parent writes them */
+void test_cow_fork()
+{
+    struct mm *old = current()->mm;
+    struct mm *parent = mm_alloc();
+    struct mm *child;
+    volatile uint32_t *p = (uint32_t*)USER_BASE;
+    uint32_t start, fork_cycles = 0, copy_cycles = 0;
+    int i;
+
+    panic_on(parent == NULL, "alloc mm failed\n");
+    panic_on(add_vma(parent, USER_BASE, USER_BASE + FORK_BENCH_PAGES * PAGE_SIZE, VM_READ | VM_WRITE, 0),
+             "add vma failed\n");
+    current()->mm = parent;
+    switch_mm(old, parent);
+    for (i = 0; i < FORK_BENCH_PAGES; ++i)
+        p[i * PAGE_SIZE / sizeof(*p)] = i;
+
+    /* parent writes after fork, child must still see the old content */
+    child = dup_mm(parent);
+    panic_on(child == NULL, "dup mm failed\n");
+    p[0] = 100;
+    switch_mm(parent, child);
+    current()->mm = child;
+    panic_on(p[0] != 0, "child sees write of parent\n");
+    panic_on(p[PAGE_SIZE / sizeof(*p)] != 1, "child lost content of parent\n");
+    switch_mm(child, parent);
+    current()->mm = parent;
+    mm_release(child);
+    panic_on(p[0] != 100, "parent lost its write\n");
+
+    /* fork + exit of a process with FORK_BENCH_PAGES pages, compared with copying all of them */
+    for (i = 0; i < FORK_BENCH_LOOPS; ++i) {
+        start = (uint32_t)rdtsc();
+        child = dup_mm(parent);
+        panic_on(child == NULL, "dup mm failed\n");
+        mm_release(child);
+        fork_cycles += (uint32_t)rdtsc() - start;
+    }
+    for (i = 0; i < FORK_BENCH_LOOPS; ++i) {
+        void *copy = alloc_pages(6);
+        panic_on(copy == NULL, "alloc pages failed\n");
+        start = (uint32_t)rdtsc();
+        memcpy(copy, (void*)p, FORK_BENCH_PAGES * PAGE_SIZE);
+        copy_cycles += (uint32_t)rdtsc() - start;
+        free_pages(copy, 6);
+    }
+    printf("fork+exit with %d pages: %u cycles, copying the pages alone: %u cycles\n",
+           FORK_BENCH_PAGES, fork_cycles / FORK_BENCH_LOOPS, copy_cycles / FORK_BENCH_LOOPS);
+
+    switch_mm(parent, old);
+    current()->mm = old;
+    mm_release(parent);
+}
+
+/* Counters of buddy system follow allocations, and stats can be copied into a page shared by fork */
+void test_mm_stats()
+{
+    struct mm *old = current()->mm;
+    struct mm *parent = mm_alloc();
+    struct mm *child;
+    struct buddy_stats before, after;
+    volatile uint32_t *p = (uint32_t*)USER_BASE;
+    void *block;
+    int i;
+
+    mm_get_stats(&before);
+    block = alloc_pages(3);
+    panic_on(block == NULL, "alloc pages failed\n");
+    mm_get_stats(&after);
+    panic_on(after.alloc[3] != before.alloc[3] + 1, "order 3 allocation is not counted\n");
+    panic_on(after.used_pages != before.used_pages + 8 || after.peak_used_pages < after.used_pages,
+             "used pages %u, before %u\n", after.used_pages, before.used_pages);
+    free_pages(block, 3);
+    mm_get_stats(&after);
+    panic_on(after.free[3] != before.free[3] + 1, "order 3 free is not counted\n");
+    for (i = 1; i < MAX_ORDER; ++i)
+        panic_on(after.frag_index[i] < after.frag_index[i - 1] || after.frag_index[i] > 1000,
+                 "bad fragmentation index %u of order %d\n", after.frag_index[i], i);
+
+    panic_on(parent == NULL, "alloc mm failed\n");
+    panic_on(add_vma(parent, USER_BASE, USER_BASE + 2 * PAGE_SIZE, VM_READ | VM_WRITE, 0), "add vma failed\n");
+    current()->mm = parent;
+    switch_mm(old, parent);
+    p[0] = 1;
+    child = dup_mm(parent);
+    panic_on(child == NULL, "dup mm failed\n");
+    panic_on(copy_to_user((void*)p, &after, sizeof(after)), "copy to user failed\n");
+    panic_on(p[0] != after.alloc[0], "copy to user lost data\n");
+    panic_on(copy_to_user((void*)(USER_BASE + PAGE_SIZE), &after, PAGE_SIZE + 1) != -EFAULT,
+             "copy beyond vm_area is allowed\n");
+    switch_mm(parent, child);
+    current()->mm = child;
+    panic_on(p[0] != 1, "copy to user wrote the page shared with child\n");
+    switch_mm(child, parent);
+    current()->mm = parent;
+    mm_release(child);
+
+    switch_mm(parent, old);
+    current()->mm = old;
+    mm_release(parent);
+}
+
+#ifdef MM_DEBUG
+/* Allocations are recorded until they are freed, freed blocks are poisoned in quarantine */
+void test_mm_debug()
+{
+    uint32_t outstanding = mm_debug_outstanding();
+    uint8_t *page = alloc_pages(1);
+    uint8_t *obj = kmalloc(100);
+
+    panic_on(!page || !obj, "alloc failed\n");
+    panic_on(mm_debug_outstanding() != outstanding + 2, "allocations are not recorded\n");
+    free_pages(page, 1);
+    kfree(obj);
+    panic_on(mm_debug_outstanding() != outstanding, "frees are not recorded\n");
+    panic_on(page[PAGE_SIZE + 1] != MM_DEBUG_POISON || obj[99] != MM_DEBUG_POISON, "freed block is not poisoned\n");
+    mm_debug_dump();
+}
+#endif
+
+/* Ranges larger than the biggest buddy block can be allocated when memory is not fragmented */
+void test_alloc_contig()
+{
+    uint32_t nr_pages = (1 << _MAX_ORDER) + (1 << _MAX_ORDER) / 2;
+    struct buddy_stats before, after;
+    uint32_t *p;
+
+    drain_local_pages();
+    mm_get_stats(&before);
+    p = alloc_contig_pages(nr_pages);
+    panic_on(p == NULL, "alloc %u contiguous pages failed\n", nr_pages);
+    panic_on((unsigned long)p & LARGE_PAGE_MASK, "contiguous range 0x%x is not 4M aligned\n", p);
+    p[0] = 1;
+    p[(nr_pages * PAGE_SIZE) / sizeof(*p) - 1] = 2;
+    mm_get_stats(&after);
+    panic_on(after.free_pages != before.free_pages - nr_pages, "free pages %u, expect %u\n",
+             after.free_pages, before.free_pages - nr_pages);
+    free_contig_pages(p, nr_pages);
+    mm_get_stats(&after);
+    panic_on(after.free_pages != before.free_pages, "free pages %u after free, expect %u\n",
+             after.free_pages, before.free_pages);
+}
+
+/* GFP_DMA blocks are below 16M, ordinary allocations come from ZONE_NORMAL as long as it has memory */
+void test_alloc_zones()
+{
+    struct buddy_stats stats;
+    uint32_t *dma, *normal;
+    uint32_t i;
+
+    mm_get_stats(&stats);
+    dma = __alloc_pages(GFP_DMA | __GFP_ZERO, 2);
+    panic_on(dma == NULL || (unsigned long)dma + (PAGE_SIZE << 2) > MAX_DMA_ADDRESS, "bad DMA block 0x%x\n", dma);
+    for (i = 0; i < (PAGE_SIZE << 2) / sizeof(*dma); ++i)
+        panic_on(dma[i], "DMA block 0x%x is not zeroed\n", dma);
+    normal = __alloc_pages(GFP_KERNEL, 2);
+    panic_on(normal == NULL, "alloc pages failed\n");
+    panic_on(stats.zone_free[ZONE_NORMAL] > stats.watermark[ZONE_NORMAL][WMARK_HIGH] &&
+             (unsigned long)normal < MAX_DMA_ADDRESS, "block 0x%x is taken from ZONE_DMA\n", normal);
+    free_pages(dma, 2);
+    free_pages(normal, 2);
+}
+
+#define TEST_HELD_PAGES 16
+
+static void *held_pages;    // pages held by test shrinker, linked through their first word
+
+static uint32_t test_shrink(uint32_t nr_pages)
+{
+    uint32_t nr = 0;
+    void *page;
+
+    while (held_pages && nr < nr_pages) {
+        page = held_pages;
+        held_pages = *(void**)page;
+        free_pages(page, 0);
+        nr++;
+    }
+    return nr;
+}
+
+/*
+ * Allocation takes pages back from shrinkers instead of failing when memory runs low. Watermarks are raised above
+ * free memory for a while, so that the test doesn't have to use up all memory to get there.
+ */
+void test_mm_pressure()
+{
+    static struct shrinker shrinker = { "test", test_shrink };
+    struct buddy_stats before, after;
+    void *list = NULL, *page;
+    uint32_t i;
+    int z;
+
+    for (i = 0; i < TEST_HELD_PAGES; ++i) {
+        page = alloc_page();
+        panic_on(page == NULL, "alloc page failed\n");
+        *(void**)page = held_pages;
+        held_pages = page;
+    }
+    register_shrinker(&shrinker);
+    mm_get_stats(&before);
+    /* every zone is below min watermark, even after shrinkers have given all their pages back */
+    for (z = 0; z < NR_ZONES; ++z)
+        set_watermark_boost(z, before.total_pages);
+    panic_on(!mm_under_pressure(), "free pages %u are not under pressure\n", before.free_pages);
+    for (i = 0; i < TEST_HELD_PAGES; ++i) {
+        page = alloc_page();
+        panic_on(page == NULL, "alloc page failed under pressure\n");
+        *(void**)page = list;
+        list = page;
+    }
+    mm_get_stats(&after);
+    for (z = 0; z < NR_ZONES; ++z)
+        set_watermark_boost(z, 0);
+    unregister_shrinker(&shrinker);
+    panic_on(held_pages, "pages held by shrinker are not reclaimed\n");
+    panic_on(after.pressure == before.pressure || after.reclaimed < before.reclaimed + TEST_HELD_PAGES,
+             "pressure %u, reclaimed %u pages\n", after.pressure - before.pressure, after.reclaimed - before.reclaimed);
+
+    while (list) {
+        page = list;
+        list = *(void**)page;
+        free_page(page);
+    }
+    panic_on(mm_under_pressure(), "still under pressure after freeing\n");
+}
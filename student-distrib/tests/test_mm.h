@@ -1,2 +1,13 @@
 extern void test_paging();
-extern void test_alloc_pages();
\ No newline at end of file
+extern void test_alloc_pages();
+extern void test_alloc_pages_zeroed();
+extern void test_tlb_global_pages();
+extern void test_demand_paging();
+extern void test_cow_fork();
+extern void test_mm_stats();
+extern void test_alloc_contig();
+extern void test_alloc_zones();
+extern void test_mm_pressure();
+#ifdef MM_DEBUG
+extern void test_mm_debug();
+#endif
@@ -0,0 +1,86 @@
+#include "../rbtree.h"
+
+#define TEST_NR_NODES 64
+
+struct test_node {
+    uint32_t key;
+    struct rb_node node;
+};
+
+static void insert(struct rb_root *root, struct test_node *e)
+{
+    struct rb_node **link = &root->node, *parent = NULL;
+    struct test_node *cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct test_node, node);
+        link = e->key < cur->key ? &parent->left : &parent->right;
+    }
+    rb_link_node(&e->node, parent, link);
+    rb_insert_color(&e->node, root);
+}
+
+/* @return: black height of the subtree, -1 if it breaks a rule */
+static int check_subtree(struct rb_node *node, struct rb_node *parent)
+{
+    int left, right;
+
+    if (!node)
+        return 1;
+    if (node->parent != parent)
+        return -1;
+    if (node->color == RB_RED && ((node->left && node->left->color == RB_RED) ||
+                                  (node->right && node->right->color == RB_RED)))
+        return -1;
+    left = check_subtree(node->left, node);
+    right = check_subtree(node->right, node);
+    if (left < 0 || left != right)
+        return -1;
+    return left + (node->color == RB_BLACK);
+}
+
+/* Tree is balanced, and rb_first/rb_next walk through nr nodes in order */
+static bool check_tree(struct rb_root *root, int nr)
+{
+    struct rb_node *node;
+    uint32_t key, prev = 0;
+
+    if (root->node && root->node->color != RB_BLACK)
+        return false;
+    if (check_subtree(root->node, NULL) < 0)
+        return false;
+    for (node = rb_first(root); node; node = rb_next(node), --nr) {
+        key = (rb_entry(node, struct test_node, node))->key;
+        if (key < prev)
+            return false;
+        prev = key;
+    }
+    return nr == 0;
+}
+
+bool test_rbtree()
+{
+    static struct test_node entries[TEST_NR_NODES];
+    struct rb_root root = RB_ROOT;
+    int i;
+
+    for (i = 0; i < TEST_NR_NODES; ++i) {
+        entries[i].key = (i * 37) % TEST_NR_NODES;
+        insert(&root, &entries[i]);
+        if (!check_tree(&root, i + 1))
+            return false;
+    }
+    /* erase every other node, then the rest */
+    for (i = 0; i < TEST_NR_NODES; i += 2) {
+        rb_erase(&entries[i].node, &root);
+        if (!check_tree(&root, TEST_NR_NODES - i / 2 - 1))
+            return false;
+    }
+    for (i = 1; i < TEST_NR_NODES; i += 2) {
+        rb_erase(&entries[i].node, &root);
+        if (!check_tree(&root, TEST_NR_NODES / 2 - i / 2 - 1))
+            return false;
+    }
+    return root.node == NULL;
+}
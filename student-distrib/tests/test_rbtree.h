@@ -0,0 +1,7 @@
+#ifndef _TEST_RBTREE_H
+#define _TEST_RBTREE_H
+#include "../types.h"
+
+bool test_rbtree();
+
+#endif
@@ -0,0 +1,111 @@
+#include "../tasks.h"
+#include "../mm.h"
+#include "../lib.h"
+
+#define TEST_NR_TASKS 3
+#define SIM_TICK_US 1000    // as if the timer ran at 1000Hz
+
+static struct task_struct* test_task(int nice)
+{
+    struct task_struct *task = alloc_pages_zeroed(1);  // task_struct is at the bottom of its STACK_SIZE aligned stack
+
+    panic_on(task == NULL, "alloc task failed\n");
+    sched_fork(task);
+    panic_on(set_user_nice(task, nice) != nice, "set nice %d failed\n", nice);
+    return task;
+}
+
+static void free_test_tasks(struct task_struct **tasks, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (tasks[i]->on_rq)
+            deactivate_task(tasks[i]);
+        free_pages(tasks[i], 1);
+    }
+    /* idle runs again */
+    pick_next_task();
+}
+
+/* The task that has run least runs next, it's preempted after its slice, and a sleeper comes back first */
+void test_sched()
+{
+    struct task_struct *tasks[TEST_NR_TASKS];
+    struct task_struct *next, *prev;
+    unsigned long flags;
+    uint32_t ticks;
+    int i;
+
+    cli_and_save(flags);
+    for (i = 0; i < TEST_NR_TASKS; ++i) {
+        tasks[i] = test_task(0);
+        activate_task(tasks[i]);
+    }
+
+    /* equal tasks take turns, no task runs twice before the others have run once */
+    next = pick_next_task();
+    for (i = 0; i < TEST_NR_TASKS * 2; ++i) {
+        prev = next;
+        for (ticks = 0; !sched_account(next, SIM_TICK_US); ++ticks)
+            panic_on(ticks > 100, "task is not preempted after %u ticks\n", ticks);
+        next = pick_next_task();
+        panic_on(next == prev, "task of pid %u runs twice in a row\n", next->pid);
+    }
+
+    /* a task that has slept long runs as soon as it wakes up */
+    deactivate_task(tasks[0]);
+    for (ticks = 0; ticks < 100; ++ticks) {
+        if (sched_account(next, SIM_TICK_US))
+            next = pick_next_task();
+    }
+    activate_task(tasks[0]);
+    panic_on(!sched_account(next, SIM_TICK_US), "waking task doesn't preempt\n");
+    panic_on(pick_next_task() != tasks[0], "waking task doesn't run first\n");
+
+    panic_on(set_user_nice(tasks[1], MAX_NICE + 5) != MAX_NICE, "nice is not clamped\n");
+    free_test_tasks(tasks, TEST_NR_TASKS);
+    restore_flags(flags);
+}
+
+#define FAIR_NR_TASKS 4
+#define FAIR_TICKS 2000
+
+/* Run cpu bound tasks of different nice and compare their cpu shares with their weights */
+void test_sched_fairness()
+{
+    static const int nices[FAIR_NR_TASKS] = { 0, 0, 5, -5 };
+    struct task_struct *tasks[FAIR_NR_TASKS];
+    struct task_struct *next;
+    uint32_t total_weight = 0, expected, actual, dev, max_dev = 0;
+    unsigned long flags;
+    int i;
+
+    cli_and_save(flags);
+    for (i = 0; i < FAIR_NR_TASKS; ++i) {
+        tasks[i] = test_task(nices[i]);
+        total_weight += tasks[i]->weight;
+        activate_task(tasks[i]);
+    }
+
+    next = pick_next_task();
+    for (i = 0; i < FAIR_TICKS; ++i) {
+        if (sched_account(next, SIM_TICK_US))
+            next = pick_next_task();
+    }
+
+    for (i = 0; i < FAIR_NR_TASKS; ++i) {
+        expected = FAIR_TICKS * SIM_TICK_US / total_weight * tasks[i]->weight;
+        actual = (uint32_t)tasks[i]->sum_exec_runtime;
+        /* deviation from the expected share in permille */
+        dev = (actual > expected ? actual - expected : expected - actual) * 1000 / expected;
+        if (dev > max_dev)
+            max_dev = dev;
+        printf("nice %d: %u us of cpu, expected %u us\n", nices[i], actual, expected);
+    }
+    printf("max deviation of cpu share: %u permille\n", max_dev);
+    panic_on(max_dev > 50, "cpu shares don't follow weights\n");
+
+    free_test_tasks(tasks, FAIR_NR_TASKS);
+    restore_flags(flags);
+}
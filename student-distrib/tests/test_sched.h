@@ -0,0 +1,7 @@
+#ifndef _TEST_SCHED_H
+#define _TEST_SCHED_H
+
+extern void test_sched();
+extern void test_sched_fairness();
+
+#endif
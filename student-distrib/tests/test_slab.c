@@ -0,0 +1,90 @@
+#include "../slab.h"
+#include "../mm.h"
+#include "../lib.h"
+#include "../liballoc.h"
+
+#define TEST_OBJ_MAGIC 0x51ab51ab
+#define TEST_NR_OBJS 200
+
+struct test_obj {
+    uint32_t magic;
+    char data[60];
+};
+
+static void test_obj_ctor(void *obj)
+{
+    ((struct test_obj*)obj)->magic = TEST_OBJ_MAGIC;
+}
+
+bool test_slab()
+{
+    struct kmem_cache *cache;
+    struct test_obj *objs[TEST_NR_OBJS];
+    unsigned long offset0 = 0, offset1 = 0;
+    int i, j;
+
+    cache = kmem_cache_create("test_obj", sizeof(struct test_obj), CACHE_LINE_SIZE, test_obj_ctor);
+    if (!cache)
+        return false;
+
+    for (i = 0; i < TEST_NR_OBJS; ++i) {
+        objs[i] = kmem_cache_alloc(cache);
+        if (!objs[i] || objs[i]->magic != TEST_OBJ_MAGIC || ((unsigned long)objs[i] % CACHE_LINE_SIZE))
+            return false;
+        if (virt_to_cache(objs[i]) != cache)
+            return false;
+        for (j = 0; j < i; ++j) {
+            if (objs[j] == objs[i])
+                return false;
+        }
+    }
+    /* the first objects of the first two slabs start at different colors */
+    offset0 = (unsigned long)objs[0] & ((PAGE_SIZE << cache->order) - 1);
+    offset1 = (unsigned long)objs[cache->nr_objs] & ((PAGE_SIZE << cache->order) - 1);
+    if (cache->colors > 1 && offset0 == offset1)
+        return false;
+    if (cache->nr_active != TEST_NR_OBJS)
+        return false;
+
+    for (i = 0; i < TEST_NR_OBJS; ++i)
+        kmem_cache_free(cache, objs[i]);
+    slab_show_statistics();
+    if (cache->nr_active || cache->nr_slabs > 1)
+        return false;
+    /* the empty slab kept for reuse is given back on demand */
+    i = cache->nr_slabs;
+    if (kmem_cache_shrink(cache) != ((uint32_t)i << cache->order) || cache->nr_slabs)
+        return false;
+
+    kmem_cache_destroy(cache);
+    return true;
+}
+
+bool test_kmalloc()
+{
+    static const size_t sizes[] = { 1, 16, 17, 96, 100, 192, 300, 2048, 2049, 5000, 40000 };
+    char *p[sizeof(sizes) / sizeof(sizes[0])];
+    uint32_t i, j;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        p[i] = kmalloc(sizes[i]);
+        if (!p[i] || (unsigned long)p[i] % 16)
+            return false;
+        memset(p[i], i, sizes[i]);
+    }
+    /* small requests come from slab, large ones are whole buddy blocks */
+    if (!virt_to_cache(p[0]) || virt_to_cache(p[8]) || ((unsigned long)p[8] & PAGE_MASK))
+        return false;
+
+    p[4] = krealloc(p[4], 1000);
+    if (!p[4])
+        return false;
+    for (j = 0; j < sizes[4]; ++j) {
+        if (p[4][j] != 4)
+            return false;
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        kfree(p[i]);
+    liballoc_dump();
+    return true;
+}
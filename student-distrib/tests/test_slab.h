@@ -0,0 +1,8 @@
+#ifndef _TEST_SLAB_H
+#define _TEST_SLAB_H
+#include "../types.h"
+
+bool test_slab();
+bool test_kmalloc();
+
+#endif
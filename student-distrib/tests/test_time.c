@@ -0,0 +1,151 @@
+#include "../timer.h"
+#include "../clocksource.h"
+#include "../lib.h"
+
+/* Conversion of cycles and nanoseconds, and monotonic time against PIT */
+void test_timekeeping()
+{
+    struct clocksource cs = { .name = "test", .shift = 22 };
+    struct timespec ts;
+    uint64_t start, elapsed, prev, now;
+    unsigned long flags;
+    int i;
+
+    ns_to_timespec(5123456789ULL, &ts);
+    panic_on(ts.tv_sec != 5 || ts.tv_nsec != 123456789, "bad timespec %u.%u\n", ts.tv_sec, ts.tv_nsec);
+
+    /* a 2GHz counter, one second of cycles is 1e9 ns, error of mult is less than 1ns in 4ms */
+    cs.mult = clocksource_khz2mult(2000000, cs.shift);
+    elapsed = clocksource_cyc2ns(&cs, 2000000000ULL);
+    panic_on(elapsed > NSEC_PER_SEC || elapsed < NSEC_PER_SEC - NSEC_PER_SEC / 1000000,
+             "2e9 cycles of 2GHz are %u ns\n", (uint32_t)elapsed);
+
+    prev = ktime_get_ns();
+    for (i = 0; i < 1000; ++i) {
+        now = ktime_get_ns();
+        panic_on(now < prev, "time goes back\n");
+        prev = now;
+    }
+
+    if (!timekeeping_continuous()) {
+        printf("no continuous clocksource, skip time precision test\n");
+        return;
+    }
+    cli_and_save(flags);
+    pit_calibrate_start(CALIBRATE_MS);
+    start = ktime_get_ns();
+    while (!pit_calibrate_done())
+        ;
+    elapsed = ktime_get_ns() - start;
+    restore_flags(flags);
+    /* 10ms of PIT, allow 2% for the time between programming PIT and reading clock */
+    panic_on(elapsed < CALIBRATE_MS * NSEC_PER_MSEC * 98 / 100 || elapsed > CALIBRATE_MS * NSEC_PER_MSEC * 102 / 100,
+             "%u ms of PIT are %u ns\n", CALIBRATE_MS, (uint32_t)elapsed);
+}
+
+static uint32_t wheel_now;
+static uint32_t wheel_fired;
+
+static void wheel_timer_fn(unsigned long data)
+{
+    struct timer_list *timer = (struct timer_list*)data;
+
+    panic_on(timer->expires != wheel_now, "timer of %u runs at %u\n", timer->expires, wheel_now);
+    wheel_fired++;
+}
+
+static void wheel_late_fn(unsigned long data)
+{
+    wheel_fired++;
+}
+
+/* A periodic timer, it adds itself again for a round of tv1 later, which hashes to the slot being run */
+static void wheel_periodic_fn(unsigned long data)
+{
+    struct timer_list *timer = (struct timer_list*)data;
+
+    panic_on(timer->expires != wheel_now, "periodic timer of %u runs at %u\n", timer->expires, wheel_now);
+    if (++wheel_fired < 4)
+        __mod_timer(timer->base, timer, timer->expires + TVR_SIZE);
+}
+
+/*
+ * Timers of tv1 and tv2 run exactly at their expires, across wrap of jiffies. Timers of coarser wheels are put
+ * around the jiffies their slots are cascaded, and time jumps to them, as stepping there would take too long.
+ */
+void test_timer_wheel()
+{
+    static struct tvec_base base;
+    static struct timer_list timers[2000];
+    /* after start, start is at a tv1 and tv2 boundary */
+    static const uint32_t far[] = {
+        TVR_SIZE << TVN_BITS, (TVR_SIZE << TVN_BITS) + 1, (TVR_SIZE << (2 * TVN_BITS)) - 1,
+        TVR_SIZE << (2 * TVN_BITS), (TVR_SIZE << (2 * TVN_BITS)) + TVR_SIZE + 1,
+    };
+    static struct timer_list far_timers[sizeof(far) / sizeof(far[0])];
+    struct timer_list *timer;
+    uint32_t start = 0xfffff000, last = 0;
+    int i;
+
+    timer_base_init(&base, start);
+    for (i = 0; i < 2000; ++i) {
+        timer = &timers[i];
+        setup_timer(timer, wheel_timer_fn, (unsigned long)timer);
+        /* spread over tv1 and tv2 */
+        __mod_timer(&base, timer, start + (i * 7919U) % (1U << (TVR_BITS + (i % 2) * TVN_BITS)));
+        if (timer->expires - start > last)
+            last = timer->expires - start;
+    }
+    for (i = 0; i < sizeof(far) / sizeof(far[0]); ++i) {
+        setup_timer(&far_timers[i], wheel_timer_fn, (unsigned long)&far_timers[i]);
+        __mod_timer(&base, &far_timers[i], start + far[i]);
+    }
+    panic_on(base.nr_pending != 2000 + i, "%u timers pending\n", base.nr_pending);
+
+    /* move a timer from tv2 to tv1, delete one of tv1 */
+    panic_on(!__mod_timer(&base, &timers[3], start + 3), "timer was not pending\n");
+    panic_on(!del_timer(&timers[2]) || timer_pending(&timers[2]), "timer is still pending\n");
+    panic_on(del_timer(&timers[2]), "timer was deleted\n");
+    panic_on(__next_timer_interrupt(&base) != start, "next timer at %u\n", __next_timer_interrupt(&base));
+
+    for (wheel_now = start; wheel_now != start + last + 1; ++wheel_now)
+        __run_timers(&base, wheel_now);
+    panic_on(wheel_fired != 1999, "%u timers run\n", wheel_fired);
+
+    /* a late tick runs timers of each jiffy it has missed, nothing expires before the jiffy of a far timer */
+    for (i = 0; i < sizeof(far) / sizeof(far[0]); ++i) {
+        wheel_now = start + far[i] - 1;
+        __run_timers(&base, wheel_now);
+        panic_on(wheel_fired != 1999 + i, "far timer %u runs early\n", far[i]);
+        wheel_now++;
+        __run_timers(&base, wheel_now);
+        panic_on(wheel_fired != 2000 + i, "far timer %u didn't run\n", far[i]);
+    }
+    panic_on(base.nr_pending, "%u timers pending\n", base.nr_pending);
+    wheel_now++;
+    panic_on(__next_timer_interrupt(&base) - wheel_now < 0x10000000, "no timer should be pending\n");
+
+    /* an expired timer runs in next tick, a late tick runs all expired timers */
+    wheel_fired = 0;
+    setup_timer(&timers[0], wheel_late_fn, 0);
+    setup_timer(&timers[1], wheel_late_fn, 0);
+    __mod_timer(&base, &timers[0], wheel_now + 300);
+    __mod_timer(&base, &timers[1], wheel_now - 5);
+    panic_on(__next_timer_interrupt(&base) != wheel_now, "expired timer is not next\n");
+    __run_timers(&base, wheel_now);
+    panic_on(wheel_fired != 1, "expired timer didn't run\n");
+    /* the timer is in tv2, next timer interrupt may be the jiffy to cascade it */
+    panic_on(__next_timer_interrupt(&base) - wheel_now > 300, "next timer at %u\n", __next_timer_interrupt(&base));
+    __run_timers(&base, wheel_now + 1000);
+    panic_on(wheel_fired != 2 || base.nr_pending, "late tick runs %u timers\n", wheel_fired);
+    wheel_now += 1001;
+
+    /* a timer that adds itself again in its function runs once per round of tv1 */
+    wheel_fired = 0;
+    setup_timer(&timers[0], wheel_periodic_fn, (unsigned long)&timers[0]);
+    __mod_timer(&base, &timers[0], wheel_now + 10);
+    last = wheel_now + 10 + 3 * TVR_SIZE;
+    for (; wheel_now != last + 1; ++wheel_now)
+        __run_timers(&base, wheel_now);
+    panic_on(wheel_fired != 4 || base.nr_pending, "periodic timer runs %u times\n", wheel_fired);
+}
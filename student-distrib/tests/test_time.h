@@ -0,0 +1,7 @@
+#ifndef _TEST_TIME_H
+#define _TEST_TIME_H
+
+extern void test_timekeeping();
+extern void test_timer_wheel();
+
+#endif
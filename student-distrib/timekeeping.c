@@ -0,0 +1,149 @@
+#include "clocksource.h"
+#include "timer.h"
+#include "list.h"
+#include "lib.h"
+
+/*
+ * @NOTE: about timekeeping
+ *   Monotonic time is the nanoseconds at the last update plus the cycles of clocksource since then. It's updated
+ *   by every tick so that the cycles since last update are few enough to convert without overflow, and jiffies
+ *   is brought up to date from it, including the ticks skipped while the tick was stopped.
+ *   Without a continuous clocksource, time is counted in jiffies, it can't be finer than a tick.
+ */
+#define TSC_SHIFT 22    // mult of a tsc above 1MHz fits in 32 bits
+
+volatile uint32_t jiffies;
+
+static struct list clocksource_list = { &clocksource_list, &clocksource_list };
+
+static struct {
+    struct clocksource *clock;
+    uint64_t cycle_last;
+    uint64_t ns;                    // monotonic time at cycle_last
+    uint64_t last_jiffies_update;   // monotonic time of the last jiffy
+} tk;
+
+static uint64_t jiffies_read(struct clocksource *cs)
+{
+    return jiffies;
+}
+
+static struct clocksource clocksource_jiffies = {
+    .name = "jiffies",
+    .rating = 1,
+    .read = jiffies_read,
+    .mask = 0xffffffff,
+    .mult = TICK_NS,
+    .shift = 0,
+};
+
+static uint64_t tsc_read(struct clocksource *cs)
+{
+    return rdtsc();
+}
+
+static struct clocksource clocksource_tsc = {
+    .name = "tsc",
+    .rating = 300,
+    .read = tsc_read,
+    .mask = ~0ULL,
+    .shift = TSC_SHIFT,
+    .flags = CLOCK_SOURCE_IS_CONTINUOUS,
+};
+
+/* mult of a clocksource counting khz cycles per millisecond */
+uint32_t clocksource_khz2mult(uint32_t khz, uint32_t shift)
+{
+    return (uint32_t)div_u64((uint64_t)NSEC_PER_MSEC << shift, khz);
+}
+
+/* Move tk.ns to now. @NOTE: caller must disable interrupts */
+static void timekeeping_forward()
+{
+    struct clocksource *clock = tk.clock;
+    uint64_t now = clock->read(clock);
+
+    tk.ns += clocksource_cyc2ns(clock, (now - tk.cycle_last) & clock->mask);
+    tk.cycle_last = now;
+}
+
+void clocksource_register(struct clocksource *cs)
+{
+    unsigned long flags;
+
+    cli_and_save(flags);
+    list_add_tail(&clocksource_list, &cs->list);
+    if (!tk.clock || cs->rating > tk.clock->rating) {
+        /* time goes on from where the old clocksource is */
+        if (tk.clock)
+            timekeeping_forward();
+        tk.clock = cs;
+        tk.cycle_last = cs->read(cs);
+    }
+    restore_flags(flags);
+}
+
+/* Needs tsc_khz, see calibrate_tsc() */
+void timekeeping_init()
+{
+    clocksource_register(&clocksource_jiffies);
+    if (tsc_khz) {
+        clocksource_tsc.mult = clocksource_khz2mult(tsc_khz, clocksource_tsc.shift);
+        clocksource_register(&clocksource_tsc);
+    }
+    printf("clocksource: %s\n", tk.clock->name);
+}
+
+bool timekeeping_continuous()
+{
+    return tk.clock && (tk.clock->flags & CLOCK_SOURCE_IS_CONTINUOUS);
+}
+
+/* @return: nanoseconds since timekeeping_init() */
+uint64_t ktime_get_ns()
+{
+    struct clocksource *clock;
+    unsigned long flags;
+    uint64_t ns;
+
+    cli_and_save(flags);
+    clock = tk.clock;
+    if (!clock) {
+        restore_flags(flags);
+        return 0;
+    }
+    ns = tk.ns + clocksource_cyc2ns(clock, (clock->read(clock) - tk.cycle_last) & clock->mask);
+    restore_flags(flags);
+    return ns;
+}
+
+void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    uint64_t sec = div_u64(ns, NSEC_PER_SEC);
+
+    ts->tv_sec = (uint32_t)sec;
+    ts->tv_nsec = (uint32_t)(ns - sec * NSEC_PER_SEC);
+}
+
+/* Called by every tick. @NOTE: caller must disable interrupts */
+void update_wall_time()
+{
+    uint64_t delta, ticks;
+
+    if (!tk.clock)
+        return;
+    if (!timekeeping_continuous()) {
+        /* jiffies is the clocksource */
+        jiffies++;
+        timekeeping_forward();
+        return;
+    }
+
+    timekeeping_forward();
+    delta = tk.ns - tk.last_jiffies_update;
+    if (delta >= TICK_NS) {
+        ticks = div_u64(delta, TICK_NS);
+        jiffies += (uint32_t)ticks;
+        tk.last_jiffies_update += ticks * TICK_NS;
+    }
+}
@@ -1,83 +1,228 @@
 #include "timer.h"
+#include "clockevents.h"
+#include "clocksource.h"
+#include "apic.h"
 #include "i8259.h"
 #include "intr.h"
 #include "list.h"
 #include "tasks.h"
 #include "x86_desc.h"
+#include "lib.h"
 
-static void __switch_to();
-
-#define update_tss(task) tss.esp0 = (unsigned long)(((char*)task)+STACK_SIZE)
-
-#define switch_to(cur,new) \
-do  {   \
-    asm volatile ("pusha;"           \
-         "pushl %%ds;"       \
-         "pushl %%es;"       \
-         "pushl %%fs;"       \
-         "pushl %%gs;"       \
-         "sti;"              \
-         "movl %%esp, %0;" /* save esp */     \
-         "movl %2, %%esp;" /* restore esp */  \
-         "movl $1f, %1;"  /* save eip */    \
-         "jmp %3;"      /* restore eip */   \
-         /* "pushl %3"
-            "jmp __switch_to;"
-            We cannot jmp __switch_to function, because 'push %ebp; movl %esp %ebp' instrutions in function header
-            will corrupt the new task's stack.
-            So we use jmp directly
-          */ \
-         "1: popl %%gs;"    \
-         "popl %%fs;"        \
-         "popl %%es;"        \
-         "popl %%ds;"        \
-         "popa;"            \
-        :"=m"(cur->cpu_state.esp0), "=m"(cur->cpu_state.eip)     \
-        :"m"((new)->cpu_state.esp0), "m"((new)->cpu_state.eip) \
-    );  \
-} while(0)
-
-extern char init_finish;
-
-void schedule()
+/*
+ * @NOTE: about tick
+ *   The tick device interrupts HZ times a second to account run time, preempt tasks and run expired kernel
+ *   timers. A one-shot device is programmed again in every interrupt. When the idle task runs and nothing is
+ *   runnable, the tick is stopped(tick_nohz_idle_enter()) so that an idle cpu sleeps in hlt until the earliest
+ *   kernel timer expires or some device interrupts, and it's restarted when a task becomes runnable
+ *   (tick_nohz_idle_exit()). A periodic device can't be stopped, neither can the tick when time is counted in
+ *   jiffies.
+ */
+static struct list clockevent_devices = { &clockevent_devices, &clockevent_devices };
+static struct clock_event_device *tick_device;
+static bool tick_stopped;
+
+#define NOHZ_MAX_SLEEP_US 10000000  // longest time the tick may be stopped
+
+/* @return: how long the tick may be stopped in us, 0 if some timer expires in next tick */
+static uint32_t tick_nohz_sleep_us()
 {
-    struct task_struct *cur = current();
-    struct task_struct *next = NULL;
-    if (!init_finish) {
-        return;
+    uint32_t delta = get_next_timer_interrupt() - jiffies;
+
+    if ((int32_t)delta <= 1)
+        return 0;
+    if (delta >= NOHZ_MAX_SLEEP_US / TICK_US)
+        return NOHZ_MAX_SLEEP_US;
+    return delta * TICK_US;
+}
+
+void timer_handler(struct regs *cpu_state)
+{
+    struct clock_event_device *dev = tick_device;
+
+    uint32_t sleep_us = 0;
+
+    dev->ack(dev);
+    update_wall_time();
+    run_timers();
+    if (dev->mode == CLOCK_EVT_MODE_ONESHOT) {
+        /* keep the tick stopped until next timer, restart it when a timer is due in next tick */
+        if (tick_stopped && !(sleep_us = tick_nohz_sleep_us()))
+            tick_stopped = false;
+        clockevents_program_event(dev, tick_stopped ? sleep_us : TICK_US);
     }
+    if (sched_tick(current()))
+        schedule();
+}
 
-    cli();
-    if (!list_empty(&runnable_tasks)) {
-        next = list_entry(runnable_tasks.next, struct task_struct, task_list);
-    } else {
-        next = cur;
+void clockevents_register_device(struct clock_event_device *dev)
+{
+    dev->mode = CLOCK_EVT_MODE_SHUTDOWN;
+    list_add_tail(&clockevent_devices, &dev->list);
+}
+
+void clockevents_set_mode(struct clock_event_device *dev, int mode)
+{
+    dev->set_mode(dev, mode);
+    dev->mode = mode;
+}
+
+/* Raise an interrupt of a one-shot device after delta_us, delta_us is clamped to what the device supports */
+void clockevents_program_event(struct clock_event_device *dev, uint32_t delta_us)
+{
+    if (delta_us < dev->min_delta_us)
+        delta_us = dev->min_delta_us;
+    if (delta_us > dev->max_delta_us)
+        delta_us = dev->max_delta_us;
+    dev->set_next_event(dev, delta_us);
+}
+
+/*
+ * Stop the tick until next timer expires if the idle task has nothing to do. @NOTE: caller must disable interrupts
+ * It's called before every hlt of the idle task, so a timer added by an interrupt handler while the tick is
+ * stopped moves the wakeup earlier. Time is kept by clocksource meanwhile, it's read at least once in
+ * NOHZ_MAX_SLEEP_US so that the cycles since last update can be converted without overflow.
+ */
+void tick_nohz_idle_enter()
+{
+    uint32_t sleep_us;
+
+    if (tick_device->mode != CLOCK_EVT_MODE_ONESHOT || !timekeeping_continuous() || need_resched())
+        return;
+    sleep_us = tick_nohz_sleep_us();
+    if (sleep_us) {
+        tick_stopped = true;
+        clockevents_program_event(tick_device, sleep_us);
+    } else if (tick_stopped) {
+        /* a timer added while the tick was stopped expires in next tick */
+        tick_nohz_idle_exit();
     }
+}
 
-    list_del(&cur->task_list);
-    list_add_tail(&runnable_tasks, &cur->task_list);
-    cur->state = TASK_RUNNABLE;
-    list_del(&next->task_list);
-    list_add_tail(&running_tasks, &next->task_list);
-    next->state = TASK_RUNNING;
+/* Restart the tick when the idle task is going to give cpu to a task. @NOTE: caller must disable interrupts */
+void tick_nohz_idle_exit()
+{
+    if (!tick_stopped)
+        return;
+    tick_stopped = false;
+    clockevents_program_event(tick_device, TICK_US);
+}
 
-    update_tss(next);
-    switch_to(cur, next);
+/*
+ * @NOTE: about calibration
+ *   PIT channel 2 counts down CALIBRATE_MS milliseconds in mode 0, its output goes high at terminal count and can
+ *   be polled from port 0x61, so no interrupt is needed. Channel 0 which may drive the timer interrupt is not
+ *   touched. Frequencies of tsc and local APIC timer are measured by counting their cycles meanwhile.
+ */
+#define PIT_FREQ        1193182     // input clock of 8254 PIT, in Hz
+#define PIT_CH0_DATA    0x40
+#define PIT_CH2_DATA    0x42
+#define PIT_CMD         0x43
+#define PIT_CH2_CTRL    0x61        // bit0 gate of channel 2, bit1 speaker enable, bit5 output of channel 2
+
+uint32_t tsc_khz;
+
+/* Let PIT channel 2 count down ms milliseconds, ms must be less than 55 */
+void pit_calibrate_start(uint32_t ms)
+{
+    uint32_t latch = PIT_FREQ * ms / 1000;
+
+    /* gate on, speaker off */
+    outb((inb(PIT_CH2_CTRL) & ~0x02) | 0x01, PIT_CH2_CTRL);
+    /* channel 2, lobyte/hibyte access, mode 0, binary */
+    outb(0xb0, PIT_CMD);
+    outb(latch & 0xff, PIT_CH2_DATA);
+    outb(latch >> 8, PIT_CH2_DATA);
+}
+
+/* Whether the count down started by pit_calibrate_start() has finished */
+bool pit_calibrate_done()
+{
+    return (inb(PIT_CH2_CTRL) & 0x20) != 0;
 }
 
-void __switch_to()
+/* @return: tsc frequency in kHz */
+uint32_t calibrate_tsc()
 {
+    uint64_t start;
+    unsigned long flags;
 
+    cli_and_save(flags);
+    pit_calibrate_start(CALIBRATE_MS);
+    start = rdtsc();
+    while (!pit_calibrate_done())
+        ;
+    tsc_khz = (uint32_t)(rdtsc() - start) / CALIBRATE_MS;
+    restore_flags(flags);
+
+    return tsc_khz;
 }
 
-void timer_handler(struct regs *cpu_state)
+/* PIT channel 0 in rate generator mode, it's the tick device when local APIC timer can't be used */
+static void pit_set_mode(struct clock_event_device *dev, int mode)
+{
+    uint32_t latch = (PIT_FREQ + HZ / 2) / HZ;
+
+    if (mode == CLOCK_EVT_MODE_PERIODIC) {
+        /* channel 0, lobyte/hibyte access, mode 2, binary */
+        outb(0x34, PIT_CMD);
+        outb(latch & 0xff, PIT_CH0_DATA);
+        outb(latch >> 8, PIT_CH0_DATA);
+        enable_irq(PIC_TIMER_INTR);
+    } else {
+        disable_irq(PIC_TIMER_INTR);
+    }
+}
+
+static void pit_ack(struct clock_event_device *dev)
 {
     send_eoi(PIC_TIMER_INTR);
-    schedule();
 }
 
+static struct clock_event_device pit_clockevent = {
+    .name = "pit",
+    .features = CLOCK_EVT_FEAT_PERIODIC,
+    .rating = 50,
+    .irq = PIC_TIMER_INTR,
+    .khz = PIT_FREQ / 1000,
+    .set_mode = pit_set_mode,
+    .ack = pit_ack,
+};
+
 int init_timer()
 {
-    /* @TODO: support local APIC timer */
+    printf("tsc: %u kHz\n", calibrate_tsc());
+    timekeeping_init();
+    init_timers();
     return 0;
-}
\ No newline at end of file
+}
+
+/* Pick the best clock event device as tick device and start the tick. Needs paging for local APIC registers */
+int init_clockevents()
+{
+    struct clock_event_device *dev, *lapic;
+    struct list *cur;
+
+    clockevents_register_device(&pit_clockevent);
+    apic_init();
+    lapic = apic_timer_init();
+    if (lapic)
+        clockevents_register_device(lapic);
+
+    list_for_each(cur, &clockevent_devices) {
+        dev = list_entry(cur, struct clock_event_device, list);
+        if (!tick_device || dev->rating > tick_device->rating)
+            tick_device = dev;
+    }
+    if (!tick_device)
+        return -1;
+
+    if (tick_device->features & CLOCK_EVT_FEAT_ONESHOT) {
+        clockevents_set_mode(tick_device, CLOCK_EVT_MODE_ONESHOT);
+        clockevents_program_event(tick_device, TICK_US);
+    } else {
+        clockevents_set_mode(tick_device, CLOCK_EVT_MODE_PERIODIC);
+    }
+    printf("clockevent: %s, %u kHz, tick %u us\n", tick_device->name, tick_device->khz, TICK_US);
+    return 0;
+}
@@ -1,6 +1,110 @@
 #ifndef _TIMER_H
 #define _TIMER_H
 
+#include "types.h"
+#include "list.h"
+
+#define HZ 100      // timer ticks per second
+#define TICK_US (1000000 / HZ)
+
+#define NSEC_PER_USEC   1000
+#define NSEC_PER_MSEC   1000000
+#define NSEC_PER_SEC    1000000000
+#define TICK_NS (NSEC_PER_SEC / HZ)
+
+struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+};
+
+/* Ticks since boot, ticks skipped while the tick is stopped are counted too */
+extern volatile uint32_t jiffies;
+
+extern uint64_t ktime_get_ns();
+extern void ns_to_timespec(uint64_t ns, struct timespec *ts);
+
+/* Round up, a timeout never ends early */
+static inline uint32_t msecs_to_jiffies(uint32_t ms)
+{
+    return (ms + 1000 / HZ - 1) / (1000 / HZ);
+}
+
+/*
+ * @NOTE: about timer wheel
+ *   A kernel timer calls function(data) in timer interrupt once jiffies reaches expires. Pending timers are
+ *   hashed by expires into buckets of a wheel of 256 slots, one per jiffy, and four coarser wheels of 64 slots,
+ *   each slot of which covers a whole round of the wheel below. Adding and deleting a timer is O(1), a tick only
+ *   runs the slot of the current jiffy, and once every 256 ticks moves one slot of a coarser wheel down, so the
+ *   cost of a tick doesn't grow with the number of pending timers. See timer_wheel.c.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define NR_TVN   4
+
+struct tvec_base;
+
+struct timer_list {
+    struct list entry;      // in a slot of wheel, entry.next is NULL if the timer is not pending
+    uint32_t expires;       // in jiffies
+    void (*function)(unsigned long data);
+    unsigned long data;
+    struct tvec_base *base;
+};
+
+struct tvec_base {
+    uint32_t timer_jiffies;     // next jiffy to run
+    uint32_t nr_pending;
+    struct list tv1[TVR_SIZE];
+    struct list tvn[NR_TVN][TVN_SIZE];
+};
+
+static inline void setup_timer(struct timer_list *timer, void (*function)(unsigned long), unsigned long data)
+{
+    timer->entry.next = NULL;
+    timer->function = function;
+    timer->data = data;
+    timer->base = NULL;
+}
+
+static inline bool timer_pending(const struct timer_list *timer)
+{
+    return timer->entry.next != NULL;
+}
+
+extern void add_timer(struct timer_list *timer);
+extern int mod_timer(struct timer_list *timer, uint32_t expires);
+extern int del_timer(struct timer_list *timer);
+extern void run_timers();
+extern uint32_t get_next_timer_interrupt();
+extern void init_timers();
+
+extern void timer_base_init(struct tvec_base *base, uint32_t now);
+extern int __mod_timer(struct tvec_base *base, struct timer_list *timer, uint32_t expires);
+extern void __run_timers(struct tvec_base *base, uint32_t now);
+extern uint32_t __next_timer_interrupt(struct tvec_base *base);
+
+extern uint32_t schedule_timeout(uint32_t timeout);
+extern void sleep_ms(uint32_t ms);
+
 extern int init_timer();
+extern int init_clockevents();
+extern void tick_nohz_idle_enter();
+extern void tick_nohz_idle_exit();
+
+extern uint32_t tsc_khz;    // tsc ticks per millisecond, 0 before calibrate_tsc()
+extern uint32_t calibrate_tsc();
+#define CALIBRATE_MS 10  // time in which frequencies are measured against PIT
+extern void pit_calibrate_start(uint32_t ms);
+extern bool pit_calibrate_done();
+
+/* Convert tsc ticks(less than 2^32) to microseconds */
+static inline uint32_t cycles_to_us(uint32_t cycles)
+{
+    if (!tsc_khz)
+        return 0;
+    return cycles / tsc_khz * 1000 + cycles % tsc_khz * 1000 / tsc_khz;
+}
 
 #endif
\ No newline at end of file
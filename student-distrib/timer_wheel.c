@@ -0,0 +1,245 @@
+#include "timer.h"
+#include "tasks.h"
+#include "list.h"
+#include "lib.h"
+
+/*
+ * @reference:
+ *  1. kernel/timer.c, linux kernel 2.6
+ */
+
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+/* a timer that expires within (1 << LEVEL_BITS(n)) jiffies goes to wheel n, tv1 is wheel 0 */
+#define LEVEL_BITS(n) (TVR_BITS + (n) * TVN_BITS)
+/* slot of wheel n the jiffy falls in, n > 0 */
+#define TVN_INDEX(j, n) (((j) >> LEVEL_BITS((n) - 1)) & TVN_MASK)
+
+/* timers of the kernel, run in timer interrupt */
+static struct tvec_base timer_base;
+
+void timer_base_init(struct tvec_base *base, uint32_t now)
+{
+    int i, j;
+
+    base->timer_jiffies = now;
+    base->nr_pending = 0;
+    for (i = 0; i < TVR_SIZE; ++i)
+        INIT_LIST(&base->tv1[i]);
+    for (i = 0; i < NR_TVN; ++i) {
+        for (j = 0; j < TVN_SIZE; ++j)
+            INIT_LIST(&base->tvn[i][j]);
+    }
+}
+
+/* Hash the timer into the slot its expires falls in, relative to timer_jiffies */
+static void internal_add_timer(struct tvec_base *base, struct timer_list *timer)
+{
+    uint32_t expires = timer->expires;
+    uint32_t idx = expires - base->timer_jiffies;
+    struct list *slot;
+    int n;
+
+    if ((int32_t)idx < 0) {
+        /* already expired, run it in next tick */
+        slot = &base->tv1[base->timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        slot = &base->tv1[expires & TVR_MASK];
+    } else {
+        /* at most 2^31 jiffies ahead, the last wheel covers all */
+        for (n = 1; n < NR_TVN && idx >= (1U << LEVEL_BITS(n)); ++n)
+            ;
+        slot = &base->tvn[n - 1][TVN_INDEX(expires, n)];
+    }
+    list_add_tail(slot, &timer->entry);
+}
+
+/* Move timers of a slot of a coarser wheel to finer wheels. @return: the slot index, 0 means one more cascade */
+static int cascade(struct tvec_base *base, int n)
+{
+    int index = TVN_INDEX(base->timer_jiffies, n);
+    struct list *slot = &base->tvn[n - 1][index];
+    struct list *cur;
+    struct timer_list *timer;
+
+    while (!list_empty(slot)) {
+        cur = slot->next;
+        list_del(cur);
+        timer = list_entry(cur, struct timer_list, entry);
+        internal_add_timer(base, timer);
+    }
+    return index;
+}
+
+/* @return: whether the timer was pending. @NOTE: caller must disable interrupts */
+static int detach_timer(struct timer_list *timer)
+{
+    if (!timer_pending(timer))
+        return 0;
+    list_del(&timer->entry);
+    timer->base->nr_pending--;
+    return 1;
+}
+
+/*
+ * Let the timer expire at jiffy expires on base, whether it's pending or not
+ * @return: whether the timer was pending
+ */
+int __mod_timer(struct tvec_base *base, struct timer_list *timer, uint32_t expires)
+{
+    unsigned long flags;
+    int ret;
+
+    panic_on(!timer->function, "timer without function\n");
+    cli_and_save(flags);
+    ret = detach_timer(timer);
+    timer->expires = expires;
+    timer->base = base;
+    base->nr_pending++;
+    internal_add_timer(base, timer);
+    restore_flags(flags);
+    return ret;
+}
+
+/* Run all timers expired at or before jiffy now, in order of their expires */
+void __run_timers(struct tvec_base *base, uint32_t now)
+{
+    struct timer_list *timer;
+    struct list work;
+    unsigned long flags;
+    int index, n;
+
+    cli_and_save(flags);
+    while ((int32_t)(now - base->timer_jiffies) >= 0) {
+        index = base->timer_jiffies & TVR_MASK;
+        /* tv1 has gone round, bring down timers of next 256 jiffies */
+        if (!index) {
+            for (n = 1; n <= NR_TVN && !cascade(base, n); ++n)
+                ;
+        }
+        base->timer_jiffies++;
+        /* a timer added again for 256 jiffies later hashes to the same slot, it must not run in this round */
+        list_replace_init(&base->tv1[index], &work);
+        while (!list_empty(&work)) {
+            timer = list_entry(work.next, struct timer_list, entry);
+            detach_timer(timer);
+            timer->function(timer->data);
+        }
+    }
+    restore_flags(flags);
+}
+
+/*
+ * @return: the jiffy the earliest timer of base expires, or a jiffy at which timers of coarser wheels have to be
+ *   cascaded, no timer expires before it. It's about 2^31 jiffies ahead if no timer is pending.
+ */
+uint32_t __next_timer_interrupt(struct tvec_base *base)
+{
+    uint32_t j = base->timer_jiffies;
+    unsigned long flags;
+    int i;
+
+    cli_and_save(flags);
+    if (!base->nr_pending) {
+        restore_flags(flags);
+        return j + 0x7fffffff;
+    }
+    /* tv1 up to next cascade */
+    for (i = j & TVR_MASK; i < TVR_SIZE; ++i, ++j) {
+        if (!list_empty(&base->tv1[i]))
+            break;
+    }
+    restore_flags(flags);
+    return j;
+}
+
+void add_timer(struct timer_list *timer)
+{
+    panic_on(timer_pending(timer), "timer is already pending\n");
+    __mod_timer(&timer_base, timer, timer->expires);
+}
+
+/* @return: whether the timer was pending */
+int mod_timer(struct timer_list *timer, uint32_t expires)
+{
+    return __mod_timer(&timer_base, timer, expires);
+}
+
+/* @return: whether the timer was pending, its function won't be called after that */
+int del_timer(struct timer_list *timer)
+{
+    unsigned long flags;
+    int ret;
+
+    cli_and_save(flags);
+    ret = detach_timer(timer);
+    restore_flags(flags);
+    return ret;
+}
+
+/* Called in timer interrupt after jiffies is updated */
+void run_timers()
+{
+    __run_timers(&timer_base, jiffies);
+}
+
+uint32_t get_next_timer_interrupt()
+{
+    return __next_timer_interrupt(&timer_base);
+}
+
+void init_timers()
+{
+    timer_base_init(&timer_base, jiffies);
+}
+
+static void process_timeout(unsigned long data)
+{
+    wake_up_process((struct task_struct*)data);
+}
+
+/*
+ * Sleep until timeout jiffies have passed or the task is woken up. The caller sets the state of current task
+ * to TASK_INTERRUPTIBLE or TASK_UNINTERRUPTIBLE before calling it.
+ * The idle task can't leave runqueue, it waits in hlt instead, so timer interrupt must be enabled.
+ * @return: jiffies left, 0 if timeout has passed
+ */
+uint32_t schedule_timeout(uint32_t timeout)
+{
+    struct task_struct *task = current();
+    struct timer_list timer;
+    uint32_t expires = jiffies + timeout;
+    unsigned long flags;
+    int32_t left;
+
+    setup_timer(&timer, process_timeout, (unsigned long)task);
+    cli_and_save(flags);
+    mod_timer(&timer, expires);
+    if (is_idle_task(task)) {
+        task->state = TASK_RUNNING;
+        while (timer_pending(&timer)) {
+            safe_halt();
+            cli();
+        }
+    } else {
+        deactivate_task(task);
+        schedule();
+        cli();
+        del_timer(&timer);
+    }
+    restore_flags(flags);
+
+    left = (int32_t)(expires - jiffies);
+    return left > 0 ? left : 0;
+}
+
+/* Sleep at least ms milliseconds */
+void sleep_ms(uint32_t ms)
+{
+    uint32_t timeout = msecs_to_jiffies(ms) + 1;    // the current jiffy is partly gone
+
+    while (timeout) {
+        current()->state = TASK_UNINTERRUPTIBLE;
+        timeout = schedule_timeout(timeout);
+    }
+}